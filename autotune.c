@@ -0,0 +1,260 @@
+/*
+ * autotune - choose the thread count and queue depth for -t 0
+ *
+ * The device's nr_requests bounds how many reads are worth having in
+ * flight.  A short calibration then reads the first free extents of the
+ * plan with 1, 2, 4, ... readers at a time, each level on blocks no
+ * earlier level touched so the page cache cannot flatter it, and stops
+ * once doubling the readers gains less than a tenth.  The best level is
+ * shared out as threads and, with io_uring, queue depth.  A rotational
+ * device always gets a single thread, since several would make the head
+ * seek between their ranges; it gets an ordered pipeline instead, so the
+ * CPUs still check in parallel.
+ *
+ * The calibration only reads, so it is safe with -n.  Its reads go
+ * through the rate limits and the latency throttle like any others, so
+ * it is no harder on a busy device than the run itself.
+ *
+ * This file may be redistributed under the terms of the GNU General Public
+ * License, version 2.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "autotune.h"
+#include "ratelimit.h"
+#include "throttle.h"
+
+/* time spent reading at each level */
+#define CALIBRATE_SECONDS	0.2
+
+/* O_DIRECT wants offsets and lengths in whole logical blocks */
+#define DIRECT_ALIGN		4096
+
+struct calibration {
+	ext2_filsys		fs;
+	const struct zero_opts	*opts;
+	const struct work_queue	*plan;
+	int			fd;
+	unsigned int		item;		/* plan item being read */
+	blk64_t			blk;		/* where to look next */
+	blk64_t			first;		/* rest of the current extent */
+	blk64_t			left;
+	int			exhausted;	/* no free blocks left */
+	int			error;
+	unsigned long long	bytes;		/* read at this level */
+	struct timespec		start;
+	double			elapsed;	/* to the last completion */
+	pthread_mutex_t		lock;
+};
+
+static double since(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) +
+		(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/*
+ * Hand out the next chunk of free blocks, walking the plan in order.
+ * Returns 0 once the level's time is up or the free blocks run out.
+ */
+static int next_chunk(struct calibration *cal, blk64_t *blk, blk64_t *n)
+{
+	const struct work_queue *plan = cal->plan;
+	const struct work_item *item;
+	int ok = 0;
+
+	pthread_mutex_lock(&cal->lock);
+	if ( cal->error || since(&cal->start) >= CALIBRATE_SECONDS )
+		goto out;
+
+	while ( !cal->left ) {
+		if ( cal->item >= plan->count ) {
+			cal->exhausted = 1;
+			goto out;
+		}
+		item = &plan->items[cal->item];
+		if ( cal->blk < item->start )
+			cal->blk = item->start;
+		if ( cal->blk >= item->end ||
+			next_free_extent(cal->fs, cal->blk, item->end - 1,
+					&cal->first, &cal->left) ) {
+			cal->item++;
+			continue;
+		}
+		cal->blk = cal->first + cal->left;
+	}
+
+	*blk = cal->first;
+	*n = cal->left < cal->opts->chunk_blocks ? cal->left :
+						cal->opts->chunk_blocks;
+	cal->first += *n;
+	cal->left -= *n;
+	ok = 1;
+out:
+	pthread_mutex_unlock(&cal->lock);
+	return ok;
+}
+
+static void *reader(void *arg)
+{
+	struct calibration *cal = arg;
+	const struct zero_opts *opts = cal->opts;
+	unsigned int blocksize = cal->fs->blocksize;
+	struct timespec start;
+	unsigned long long off, end;
+	size_t size;
+	blk64_t blk, n;
+	ssize_t ret;
+	void *buf;
+
+	size = (size_t)cal->opts->chunk_blocks * blocksize + 2 * DIRECT_ALIGN;
+	if ( posix_memalign(&buf, DIRECT_ALIGN, size) ) {
+		pthread_mutex_lock(&cal->lock);
+		cal->error = 1;
+		pthread_mutex_unlock(&cal->lock);
+		return NULL;
+	}
+
+	while ( next_chunk(cal, &blk, &n) ) {
+		off = blk * blocksize / DIRECT_ALIGN * DIRECT_ALIGN;
+		end = (blk + n) * blocksize;
+		end = (end + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+
+		if ( opts->rate )
+			rate_read(opts->rate, end - off);
+		if ( opts->throttle )
+			throttle_begin(opts->throttle, &start);
+		ret = pread(cal->fd, buf, end - off, off);
+		if ( opts->throttle )
+			throttle_end(opts->throttle, &start);
+
+		pthread_mutex_lock(&cal->lock);
+		if ( ret < 0 )
+			cal->error = 1;
+		cal->bytes += n * blocksize;
+		cal->elapsed = since(&cal->start);
+		pthread_mutex_unlock(&cal->lock);
+	}
+
+	free(buf);
+	return NULL;
+}
+
+/*
+ * Read with nreaders threads for one level.  Returns bytes per second,
+ * or -1 if the readers could not be run.
+ */
+static double measure(struct calibration *cal, unsigned int nreaders)
+{
+	pthread_t tid[AUTO_MAX_READERS];
+	unsigned int i, started;
+
+	cal->bytes = 0;
+	cal->elapsed = 0;
+	clock_gettime(CLOCK_MONOTONIC, &cal->start);
+
+	for (started = 0; started < nreaders; started++)
+		if ( pthread_create(&tid[started], NULL, reader, cal) )
+			break;
+	for (i = 0; i < started; i++)
+		pthread_join(tid[i], NULL);
+
+	if ( started < nreaders || cal->error || !cal->elapsed )
+		return -1;
+	return cal->bytes / cal->elapsed;
+}
+
+/*
+ * Set *threads, and opts->queue_depth where the method reads and io_uring
+ * is available, from the device and a calibration.  A queue depth or -p
+ * given by the user is kept, and only the thread count is chosen.
+ * Returns -1 if the device cannot be read.
+ */
+int auto_tune(ext2_filsys fs, struct zero_opts *opts,
+		const struct work_queue *plan, long *threads)
+{
+	const struct dev_info *dev = &opts->dev;
+	struct calibration cal;
+	unsigned int readers, best_readers, max_readers, per_worker;
+	double rate, best = 0;
+	long ncpu;
+	int reads, chosen;
+
+	memset(&cal, 0, sizeof(cal));
+	cal.fs = fs;
+	cal.opts = opts;
+	cal.plan = plan;
+	pthread_mutex_init(&cal.lock, NULL);
+
+	/* not every filesystem takes O_DIRECT, and then the cache has to do */
+	cal.fd = open(opts->device, O_RDONLY | O_DIRECT);
+	if ( cal.fd < 0 )
+		cal.fd = open(opts->device, O_RDONLY);
+	if ( cal.fd < 0 ) {
+		fprintf(stderr, "failed to open %s\n", opts->device);
+		pthread_mutex_destroy(&cal.lock);
+		return -1;
+	}
+
+	max_readers = AUTO_MAX_READERS;
+	if ( dev->nr_requests && dev->nr_requests < max_readers )
+		max_readers = dev->nr_requests;
+
+	best_readers = 1;
+	for (readers = 1; readers <= max_readers; readers *= 2) {
+		rate = measure(&cal, readers);
+		if ( rate < 0 || rate < best * 1.1 )
+			break;
+		best = rate;
+		best_readers = readers;
+		if ( cal.exhausted )
+			break;
+	}
+
+	close(cal.fd);
+	pthread_mutex_destroy(&cal.lock);
+
+	ncpu = online_cpus();
+
+	/* only the default method reads, and so has a use for a depth */
+	reads = !opts->discard && !opts->punch && !opts->zeroout &&
+		!opts->blind;
+	per_worker = worker_depth(opts);
+	chosen = opts->queue_depth || opts->checkers;
+
+	*threads = (best_readers + per_worker - 1) / per_worker;
+	if ( *threads > ncpu )
+		*threads = ncpu;
+	if ( dev->rotational || opts->ordered || *threads < 1 )
+		*threads = 1;
+	if ( *threads > plan->count && plan->count )
+		*threads = plan->count;
+
+	if ( dev->rotational && reads && !chosen ) {
+		opts->ordered = 1;
+		opts->checkers = ncpu;
+	}
+#ifdef HAVE_LIBURING
+	else if ( reads && !chosen && best_readers > *threads )
+		opts->queue_depth = (best_readers + *threads - 1) / *threads;
+#endif
+
+	printf("auto: rotational %llu, nr_requests %llu, %u readers at"
+		" %.1f MB/s: %ld thread%s, queue depth %u%s\n",
+		dev->rotational, dev->nr_requests, best_readers,
+		best / (1024 * 1024), *threads, *threads == 1 ? "" : "s",
+		reads ? opts->queue_depth : 0,
+		opts->ordered ? ", ordered" : "");
+
+	return 0;
+}
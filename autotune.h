@@ -0,0 +1,19 @@
+/*
+ * autotune - choose the thread count and queue depth for -t 0
+ *
+ * This file may be redistributed under the terms of the GNU General Public
+ * License, version 2.
+ */
+#ifndef ZEROFREE_AUTOTUNE_H
+#define ZEROFREE_AUTOTUNE_H
+
+#include "zerofree.h"
+#include "workq.h"
+
+/* most readers the calibration ever runs at once */
+#define AUTO_MAX_READERS	64
+
+int auto_tune(ext2_filsys fs, struct zero_opts *opts,
+		const struct work_queue *plan, long *threads);
+
+#endif
@@ -0,0 +1,143 @@
+/*
+ * bench_fillcheck - time the fill-check kernels at several block sizes
+ *
+ * Every block of a buffer of zeros is tested one at a time, as zerofree
+ * and sparsify test the blocks they read, first with the byte loop that
+ * sparsify used to have and then with each kernel this CPU can run.  A
+ * small buffer shows the kernels on data already in the cache; a large
+ * one (-m 256) shows where memory bandwidth takes over.
+ *
+ *   make bench
+ *   ./bench_fillcheck [-r repeats] [-m MiB]
+ *
+ * This file may be redistributed under the terms of the GNU General Public
+ * License, version 2.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "fillcheck.h"
+
+#define USAGE "usage: %s [-r repeats] [-m MiB]\n"
+
+static const size_t block_sizes[] = { 1024, 4096, 65536 };
+
+static const char *const kernel_names[] = {
+	"generic", "sse2", "avx2", "avx512"
+};
+
+#define NUM(a)	(sizeof(a)/sizeof((a)[0]))
+
+/* the test sparsify made before it used fill_check() */
+static int __attribute__ ((noinline)) byte_loop(const void *buf, size_t len,
+		unsigned char val)
+{
+	const unsigned char *p = buf;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		if ( p[i] != val )
+			return 0;
+	return 1;
+}
+
+static double now(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/*
+ * Check every block of buf repeats times and return GB/s.
+ */
+static double run(int (*check)(const void *, size_t, unsigned char),
+		const unsigned char *buf, size_t total, size_t bs, long repeats)
+{
+	volatile int sink = 0;
+	double start;
+	size_t off;
+	long r;
+
+	start = now();
+	for (r = 0; r < repeats; r++)
+		for (off = 0; off + bs <= total; off += bs)
+			sink += check(buf + off, bs, 0);
+
+	return (double)repeats * (total / bs * bs) / (now() - start) / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+	long repeats = 0, mib = 1;
+	unsigned char *buf;
+	size_t total;
+	unsigned int i, k;
+	char *endptr;
+	int c;
+
+	while ( (c=getopt(argc, argv, "r:m:")) != -1 ) {
+		switch (c) {
+		case 'r':
+			repeats = strtol(optarg, &endptr, 0);
+			if ( !*optarg || *endptr || repeats < 1 ) {
+				fprintf(stderr, USAGE, argv[0]);
+				return 1;
+			}
+			break;
+		case 'm':
+			mib = strtol(optarg, &endptr, 0);
+			if ( !*optarg || *endptr || mib < 1 || mib > 65536 ) {
+				fprintf(stderr, USAGE, argv[0]);
+				return 1;
+			}
+			break;
+		default:
+			fprintf(stderr, USAGE, argv[0]);
+			return 1;
+		}
+	}
+
+	/* about 4 GB checked per kernel and block size */
+	total = (size_t)mib << 20;
+	if ( !repeats )
+		repeats = mib >= 4096 ? 1 : 4096 / mib;
+
+	buf = malloc(total);
+	if ( buf == NULL ) {
+		fprintf(stderr, "%s: out of memory\n", argv[0]);
+		return 1;
+	}
+	memset(buf, 0, total);
+
+	printf("%ld MiB buffer, %ld passes, GB/s\n", mib, repeats);
+	printf("%8s %10s", "block", "byte-loop");
+	for (k = 0; k < NUM(kernel_names); k++)
+		printf(" %8s", kernel_names[k]);
+	printf("\n");
+
+	for (i = 0; i < NUM(block_sizes); i++) {
+		printf("%8zu %10.1f", block_sizes[i],
+			run(byte_loop, buf, total, block_sizes[i], repeats));
+
+		/* a kernel the CPU lacks falls back to a narrower one */
+		for (k = 0; k < NUM(kernel_names); k++) {
+			setenv("FILLCHECK", kernel_names[k], 1);
+			fill_check_init();
+			if ( strcmp(fill_check_name(), kernel_names[k]) ) {
+				printf(" %8s", "-");
+				continue;
+			}
+			printf(" %8.1f", run(fill_check, buf, total,
+						block_sizes[i], repeats));
+		}
+		printf("\n");
+	}
+
+	free(buf);
+	return 0;
+}
@@ -0,0 +1,230 @@
+/*
+ * checkpoint - record finished block groups so a run can be resumed
+ *
+ * The checkpoint is a small text file naming the filesystem (its UUID
+ * and a checksum of its block bitmap) and the way the run clears free
+ * blocks, and holding one bit per block group that has been finished.
+ * It is rewritten atomically: a new copy is written and synced next to
+ * the old one and then renamed over it.
+ *
+ * This file may be redistributed under the terms of the GNU General Public
+ * License, version 2.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+
+#include "checkpoint.h"
+
+#define CKPT_MAGIC	"zerofree-checkpoint 2"
+
+/*
+ * A resumed run is only safe if the same blocks are still free, so the
+ * whole block bitmap goes into the checksum.
+ */
+static __u32 bitmap_csum(ext2_filsys fs)
+{
+	unsigned char buf[8192];
+	blk64_t blk, end, n;
+	__u32 crc = ~0U;
+
+	end = ext2fs_blocks_count(fs->super);
+	for (blk = fs->super->s_first_data_block; blk < end; blk += n) {
+		n = end - blk;
+		if ( n > sizeof(buf) * 8 )
+			n = sizeof(buf) * 8;
+		if ( ext2fs_get_block_bitmap_range2(fs->block_map, blk, n,
+							buf) )
+			return 0;
+		crc = ext2fs_crc32c_le(crc, buf, (n + 7) / 8);
+	}
+
+	return crc;
+}
+
+int ckpt_init(struct checkpoint *ck, ext2_filsys fs, const char *path,
+		unsigned int interval, const char *method,
+		unsigned int fillval, int dryrun)
+{
+	memset(ck, 0, sizeof(*ck));
+	ck->path = path;
+	ck->interval = interval;
+	ck->ngroups = fs->group_desc_count;
+	ck->done = calloc((ck->ngroups + 7) / 8, 1);
+	if ( ck->done == NULL )
+		return -1;
+
+	memcpy(ck->uuid, fs->super->s_uuid, sizeof(ck->uuid));
+	ck->bitmap_csum = bitmap_csum(fs);
+	ck->method = method;
+	ck->fillval = fillval;
+	ck->dryrun = dryrun;
+	ck->saved = time(NULL);
+	pthread_mutex_init(&ck->lock, NULL);
+
+	return 0;
+}
+
+/*
+ * Read back the finished groups of an earlier run.  The checkpoint must
+ * belong to this filesystem and its block bitmap must not have changed
+ * since.  The earlier run must also have cleared its groups the same
+ * way: a group a dry run, a discard or another fill value finished is
+ * not finished for this one.  Returns -1, having said why, if it cannot
+ * be used.
+ */
+int ckpt_load(struct checkpoint *ck)
+{
+	char magic[64], uuid[33], hex[3], method[16];
+	unsigned int csum, ngroups, i, byte, fillval;
+	int dryrun;
+	FILE *f;
+	int ok;
+
+	f = fopen(ck->path, "r");
+	if ( f == NULL ) {
+		fprintf(stderr, "cannot open checkpoint %s\n", ck->path);
+		return -1;
+	}
+
+	ok = fgets(magic, sizeof(magic), f) != NULL &&
+		strncmp(magic, CKPT_MAGIC "\n", sizeof(magic)) == 0 &&
+		fscanf(f, "uuid %32s\nbitmap %x\ngroups %u\n", uuid,
+			&csum, &ngroups) == 3;
+
+	for (i = 0; ok && i < 16; i++) {
+		snprintf(hex, sizeof(hex), "%02x", ck->uuid[i]);
+		ok = strncmp(uuid + 2 * i, hex, 2) == 0;
+	}
+	if ( !ok ) {
+		fprintf(stderr, "checkpoint %s is not for this filesystem\n",
+			ck->path);
+		fclose(f);
+		return -1;
+	}
+
+	if ( csum != ck->bitmap_csum || ngroups != ck->ngroups ) {
+		fprintf(stderr, "block bitmap has changed since checkpoint"
+			" %s was written\n", ck->path);
+		fclose(f);
+		return -1;
+	}
+
+	if ( fscanf(f, "mode %15s fill %x dryrun %d\ndone ", method,
+			&fillval, &dryrun) != 3 ) {
+		fprintf(stderr, "checkpoint %s is truncated\n", ck->path);
+		fclose(f);
+		return -1;
+	}
+	if ( strcmp(method, ck->method) || fillval != ck->fillval ||
+		!dryrun != !ck->dryrun ) {
+		fprintf(stderr, "checkpoint %s was written by a%s %s run with"
+			" fill value %u\n", ck->path,
+			dryrun ? " dry" : "", method, fillval);
+		fclose(f);
+		return -1;
+	}
+
+	for (i = 0; i < (ck->ngroups + 7) / 8; i++) {
+		if ( fscanf(f, "%2x", &byte) != 1 ) {
+			fprintf(stderr, "checkpoint %s is truncated\n",
+				ck->path);
+			fclose(f);
+			return -1;
+		}
+		ck->done[i] = byte;
+	}
+
+	fclose(f);
+	return 0;
+}
+
+/*
+ * Only used while planning, before any worker runs.
+ */
+int ckpt_finished(struct checkpoint *ck, dgrp_t group)
+{
+	return ck->done[group / 8] & (1 << (group % 8));
+}
+
+void ckpt_mark(struct checkpoint *ck, dgrp_t group)
+{
+	pthread_mutex_lock(&ck->lock);
+	ck->done[group / 8] |= 1 << (group % 8);
+	pthread_mutex_unlock(&ck->lock);
+}
+
+int ckpt_due(struct checkpoint *ck)
+{
+	int due;
+
+	pthread_mutex_lock(&ck->lock);
+	due = time(NULL) - ck->saved >= (time_t)ck->interval;
+	pthread_mutex_unlock(&ck->lock);
+
+	return due;
+}
+
+/*
+ * Write the checkpoint out.  If sync_fd is not -1 it is flushed first,
+ * with marking held off, so no group is recorded before its writes have
+ * reached the disk.
+ */
+int ckpt_save(struct checkpoint *ck, int sync_fd)
+{
+	char tmp[PATH_MAX];
+	FILE *f;
+	unsigned int i;
+	int ret;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", ck->path);
+
+	pthread_mutex_lock(&ck->lock);
+	ck->saved = time(NULL);
+
+	if ( sync_fd != -1 && fsync(sync_fd) ) {
+		pthread_mutex_unlock(&ck->lock);
+		fprintf(stderr, "failed to flush before checkpoint\n");
+		return -1;
+	}
+
+	f = fopen(tmp, "w");
+	if ( f == NULL ) {
+		pthread_mutex_unlock(&ck->lock);
+		fprintf(stderr, "failed to write checkpoint %s\n", tmp);
+		return -1;
+	}
+
+	fprintf(f, CKPT_MAGIC "\nuuid ");
+	for (i = 0; i < 16; i++)
+		fprintf(f, "%02x", ck->uuid[i]);
+	fprintf(f, "\nbitmap %08x\ngroups %u\n", ck->bitmap_csum,
+		ck->ngroups);
+	fprintf(f, "mode %s fill %02x dryrun %d\ndone ", ck->method,
+		ck->fillval, ck->dryrun);
+	for (i = 0; i < (ck->ngroups + 7) / 8; i++)
+		fprintf(f, "%02x", ck->done[i]);
+	fprintf(f, "\n");
+
+	ret = fflush(f) || fsync(fileno(f));
+	ret |= fclose(f);
+	if ( !ret )
+		ret = rename(tmp, ck->path);
+	pthread_mutex_unlock(&ck->lock);
+
+	if ( ret ) {
+		fprintf(stderr, "failed to write checkpoint %s\n", ck->path);
+		unlink(tmp);
+		return -1;
+	}
+
+	return 0;
+}
+
+void ckpt_free(struct checkpoint *ck)
+{
+	free(ck->done);
+	pthread_mutex_destroy(&ck->lock);
+}
@@ -0,0 +1,38 @@
+/*
+ * checkpoint - record finished block groups so a run can be resumed
+ *
+ * This file may be redistributed under the terms of the GNU General Public
+ * License, version 2.
+ */
+#ifndef ZEROFREE_CHECKPOINT_H
+#define ZEROFREE_CHECKPOINT_H
+
+#include <time.h>
+#include <pthread.h>
+#include <ext2fs/ext2fs.h>
+
+struct checkpoint {
+	const char	*path;
+	unsigned int	interval;	/* seconds between saves */
+	dgrp_t		ngroups;
+	unsigned char	*done;		/* one bit per finished group */
+	__u8		uuid[16];
+	__u32		bitmap_csum;	/* of the block bitmap */
+	const char	*method;	/* how free blocks are cleared */
+	unsigned int	fillval;
+	int		dryrun;
+	time_t		saved;		/* time of the last save */
+	pthread_mutex_t	lock;
+};
+
+int ckpt_init(struct checkpoint *ck, ext2_filsys fs, const char *path,
+		unsigned int interval, const char *method,
+		unsigned int fillval, int dryrun);
+int ckpt_load(struct checkpoint *ck);
+int ckpt_finished(struct checkpoint *ck, dgrp_t group);
+void ckpt_mark(struct checkpoint *ck, dgrp_t group);
+int ckpt_due(struct checkpoint *ck);
+int ckpt_save(struct checkpoint *ck, int sync_fd);
+void ckpt_free(struct checkpoint *ck);
+
+#endif
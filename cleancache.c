@@ -0,0 +1,186 @@
+/*
+ * cleancache - remember which block groups were left clean by a run
+ *
+ * A run records, for every block group whose free blocks it left holding
+ * the fill value, a checksum of that group's block bitmap.  The next run
+ * skips every group whose bitmap still has the same checksum, since its
+ * free blocks are the ones that were cleaned.  A group that changed at
+ * all is checked again in full.
+ *
+ * An unchanged bitmap is not enough on its own: a file written and then
+ * deleted leaves the bitmap as it was but its old blocks dirty.  So the
+ * superblock's mount and write times, mount count and lifetime write
+ * count are recorded too, and if the filesystem has been mounted or
+ * written since, the whole cache is thrown away.  Mounting alone changes
+ * them, so the cache only saves anything for an image that has stayed
+ * unmounted between runs.
+ *
+ * The cache is a small text file, replaced atomically like a checkpoint.
+ *
+ * This file may be redistributed under the terms of the GNU General Public
+ * License, version 2.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+
+#include "cleancache.h"
+
+#define CLEAN_MAGIC	"zerofree-clean 2"
+
+/*
+ * Checksum the block bitmap of one group.  0 is kept to mean "not
+ * clean", so a real checksum of 0 is moved out of its way.
+ */
+static __u32 group_csum(ext2_filsys fs, dgrp_t group, unsigned char *buf)
+{
+	blk64_t first, n;
+	__u32 crc;
+
+	first = ext2fs_group_first_block2(fs, group);
+	n = ext2fs_group_last_block2(fs, group) - first + 1;
+	if ( ext2fs_get_block_bitmap_range2(fs->block_map, first, n, buf) )
+		return 0;
+
+	crc = ext2fs_crc32c_le(~0U, buf, (n + 7) / 8);
+	return crc ? crc : 1;
+}
+
+int clean_init(struct clean_cache *cc, ext2_filsys fs, const char *path,
+		unsigned int fillval)
+{
+	unsigned char *buf;
+	dgrp_t group;
+
+	memset(cc, 0, sizeof(*cc));
+	cc->path = path;
+	cc->fillval = fillval;
+	cc->ngroups = fs->group_desc_count;
+	memcpy(cc->uuid, fs->super->s_uuid, sizeof(cc->uuid));
+	cc->mtime = fs->super->s_mtime;
+	cc->wtime = fs->super->s_wtime;
+	cc->mnt_count = fs->super->s_mnt_count;
+	cc->kbytes_written = fs->super->s_kbytes_written;
+
+	cc->csum = calloc(cc->ngroups, sizeof(*cc->csum));
+	cc->clean = calloc(cc->ngroups, 1);
+	buf = malloc((fs->super->s_blocks_per_group + 7) / 8);
+	if ( cc->csum == NULL || cc->clean == NULL || buf == NULL ) {
+		free(buf);
+		clean_free(cc);
+		return -1;
+	}
+
+	for (group = 0; group < cc->ngroups; group++)
+		cc->csum[group] = group_csum(fs, group, buf);
+
+	free(buf);
+	return 0;
+}
+
+/*
+ * Mark the groups the last run left clean and whose bitmap has not
+ * changed since.  A missing cache just means there is nothing to skip;
+ * one for another filesystem or fill value, or one saved before the
+ * filesystem was last mounted or written, is ignored.
+ */
+int clean_load(struct clean_cache *cc)
+{
+	char magic[64], uuid[33], hex[3];
+	unsigned int fillval, ngroups, i, mtime, wtime, mnt_count;
+	unsigned long long kbytes_written;
+	dgrp_t group;
+	__u32 csum;
+	FILE *f;
+	int ok;
+
+	f = fopen(cc->path, "r");
+	if ( f == NULL )
+		return 0;
+
+	ok = fgets(magic, sizeof(magic), f) != NULL &&
+		strncmp(magic, CLEAN_MAGIC "\n", sizeof(magic)) == 0 &&
+		fscanf(f, "uuid %32s\nfill %u\ngroups %u\n", uuid, &fillval,
+			&ngroups) == 3 &&
+		fillval == cc->fillval && ngroups == cc->ngroups;
+
+	for (i = 0; ok && i < 16; i++) {
+		snprintf(hex, sizeof(hex), "%02x", cc->uuid[i]);
+		ok = strncmp(uuid + 2 * i, hex, 2) == 0;
+	}
+	if ( !ok ) {
+		fprintf(stderr, "ignoring clean cache %s, it does not match"
+			" this filesystem and fill value\n", cc->path);
+		fclose(f);
+		return -1;
+	}
+
+	if ( fscanf(f, "super %x %x %u %llx\n", &mtime, &wtime, &mnt_count,
+			&kbytes_written) != 4 ||
+		mtime != cc->mtime || wtime != cc->wtime ||
+		mnt_count != cc->mnt_count ||
+		kbytes_written != cc->kbytes_written ) {
+		fprintf(stderr, "ignoring clean cache %s, the filesystem has"
+			" been mounted or written since it was saved\n",
+			cc->path);
+		fclose(f);
+		return -1;
+	}
+
+	for (group = 0; group < cc->ngroups; group++) {
+		if ( fscanf(f, "%x", &csum) != 1 )
+			break;
+		if ( csum && csum == cc->csum[group] )
+			cc->clean[group] = 1;
+	}
+
+	fclose(f);
+	return 0;
+}
+
+int clean_save(struct clean_cache *cc)
+{
+	char tmp[PATH_MAX];
+	dgrp_t group;
+	FILE *f;
+	unsigned int i;
+	int ret;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", cc->path);
+
+	f = fopen(tmp, "w");
+	if ( f == NULL ) {
+		fprintf(stderr, "failed to write clean cache %s\n", tmp);
+		return -1;
+	}
+
+	fprintf(f, CLEAN_MAGIC "\nuuid ");
+	for (i = 0; i < 16; i++)
+		fprintf(f, "%02x", cc->uuid[i]);
+	fprintf(f, "\nfill %u\ngroups %u\n", cc->fillval, cc->ngroups);
+	fprintf(f, "super %08x %08x %u %llx\n", cc->mtime, cc->wtime,
+		cc->mnt_count, (unsigned long long)cc->kbytes_written);
+	for (group = 0; group < cc->ngroups; group++)
+		fprintf(f, "%08x\n", cc->clean[group] ? cc->csum[group] : 0);
+
+	ret = fflush(f) || fsync(fileno(f));
+	ret |= fclose(f);
+	if ( !ret )
+		ret = rename(tmp, cc->path);
+
+	if ( ret ) {
+		fprintf(stderr, "failed to write clean cache %s\n", cc->path);
+		unlink(tmp);
+		return -1;
+	}
+
+	return 0;
+}
+
+void clean_free(struct clean_cache *cc)
+{
+	free(cc->csum);
+	free(cc->clean);
+}
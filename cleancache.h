@@ -0,0 +1,42 @@
+/*
+ * cleancache - remember which block groups were left clean by a run
+ *
+ * This file may be redistributed under the terms of the GNU General Public
+ * License, version 2.
+ */
+#ifndef ZEROFREE_CLEANCACHE_H
+#define ZEROFREE_CLEANCACHE_H
+
+#include <ext2fs/ext2fs.h>
+
+struct clean_cache {
+	const char	*path;
+	dgrp_t		ngroups;
+	__u32		*csum;		/* block bitmap checksum per group */
+	unsigned char	*clean;		/* per group: known to be clean */
+	__u8		uuid[16];
+	unsigned int	fillval;
+	__u32		mtime;		/* superblock fields that move when */
+	__u32		wtime;		/* the filesystem is mounted or */
+	__u16		mnt_count;	/* written */
+	__u64		kbytes_written;
+};
+
+int clean_init(struct clean_cache *cc, ext2_filsys fs, const char *path,
+		unsigned int fillval);
+int clean_load(struct clean_cache *cc);
+int clean_save(struct clean_cache *cc);
+void clean_free(struct clean_cache *cc);
+
+/* each group is handled by one worker, so neither needs a lock */
+static inline int clean_known(struct clean_cache *cc, dgrp_t group)
+{
+	return cc->clean[group];
+}
+
+static inline void clean_mark(struct clean_cache *cc, dgrp_t group)
+{
+	cc->clean[group] = 1;
+}
+
+#endif
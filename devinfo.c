@@ -0,0 +1,116 @@
+/*
+ * devinfo - queue limits of the device holding a filesystem
+ *
+ * This file may be redistributed under the terms of the GNU General Public
+ * License, version 2.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/sysmacros.h>
+
+#include "devinfo.h"
+
+/*
+ * Read a numeric attribute of the block device at path from the first of
+ * the sysfs locations in fmt that has it.  Returns 0 on success.
+ */
+static int sysfs_read(const char *path, const char **fmt, unsigned int nfmt,
+		const char *attr, unsigned long long *val)
+{
+	char name[256];
+	struct stat st;
+	FILE *f;
+	unsigned int i;
+	int ret;
+
+	if ( stat(path, &st) || !S_ISBLK(st.st_mode) )
+		return -1;
+
+	for (i = 0; i < nfmt; i++) {
+		snprintf(name, sizeof(name), fmt[i], major(st.st_rdev),
+			minor(st.st_rdev), attr);
+		f = fopen(name, "r");
+		if ( f == NULL )
+			continue;
+		ret = fscanf(f, "%llu", val);
+		fclose(f);
+		if ( ret == 1 )
+			return 0;
+	}
+
+	return -1;
+}
+
+/*
+ * Read a numeric attribute from the queue directory of a block device in
+ * sysfs.  Partitions have no queue directory of their own, so fall back
+ * to the one of the whole disk.  Returns 0 on success.
+ */
+int dev_sysfs_read(const char *path, const char *attr,
+		unsigned long long *val)
+{
+	static const char *fmt[] = {
+		"/sys/dev/block/%u:%u/queue/%s",
+		"/sys/dev/block/%u:%u/../queue/%s",
+	};
+
+	return sysfs_read(path, fmt, sizeof(fmt)/sizeof(fmt[0]), attr, val);
+}
+
+/*
+ * Find out whether the filesystem holding an image file can punch holes.
+ * The hole asked for lies past the end of the file, so the file is left
+ * untouched either way.
+ */
+static int file_can_punch(const char *path, const struct stat *st)
+{
+	int fd, ret;
+
+	fd = open(path, O_RDWR);
+	if ( fd < 0 )
+		return 0;
+
+	ret = fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			st->st_size, 4096);
+	close(fd);
+
+	return ret == 0;
+}
+
+int dev_info_probe(const char *path, struct dev_info *info)
+{
+	/* the alignment is per partition, not per queue */
+	static const char *part_fmt = "/sys/dev/block/%u:%u/%s";
+	struct stat st;
+
+	memset(info, 0, sizeof(*info));
+
+	if ( stat(path, &st) )
+		return -1;
+
+	if ( S_ISREG(st.st_mode) ) {
+		info->is_file = 1;
+		info->can_punch = file_can_punch(path, &st);
+	}
+	if ( !S_ISBLK(st.st_mode) )
+		return 0;
+
+	info->is_blkdev = 1;
+	dev_sysfs_read(path, "discard_max_bytes", &info->discard_max_bytes);
+	dev_sysfs_read(path, "discard_zeroes_data", &info->discard_zeroes_data);
+	dev_sysfs_read(path, "discard_granularity", &info->discard_granularity);
+	sysfs_read(path, &part_fmt, 1, "discard_alignment",
+			&info->discard_alignment);
+	dev_sysfs_read(path, "write_zeroes_max_bytes",
+			&info->write_zeroes_max_bytes);
+	dev_sysfs_read(path, "rotational", &info->rotational);
+	dev_sysfs_read(path, "nr_requests", &info->nr_requests);
+
+	return 0;
+}
@@ -0,0 +1,27 @@
+/*
+ * devinfo - queue limits of the device holding a filesystem
+ *
+ * This file may be redistributed under the terms of the GNU General Public
+ * License, version 2.
+ */
+#ifndef ZEROFREE_DEVINFO_H
+#define ZEROFREE_DEVINFO_H
+
+struct dev_info {
+	int			is_blkdev;	/* 0 for an image file */
+	int			is_file;	/* a regular image file */
+	int			can_punch;	/* file takes PUNCH_HOLE */
+	unsigned long long	discard_max_bytes; /* 0 if no limit known */
+	unsigned long long	discard_zeroes_data;
+	unsigned long long	discard_granularity; /* 0 if unknown */
+	unsigned long long	discard_alignment; /* bytes to 1st boundary */
+	unsigned long long	write_zeroes_max_bytes; /* 0 if unsupported */
+	unsigned long long	rotational;
+	unsigned long long	nr_requests;	/* 0 if unknown */
+};
+
+int dev_info_probe(const char *path, struct dev_info *info);
+int dev_sysfs_read(const char *path, const char *attr,
+		unsigned long long *val);
+
+#endif
@@ -0,0 +1,171 @@
+/*
+ * fillcheck - test whether a buffer holds nothing but one byte value
+ *
+ * Every free block zerofree reads, and every block sparsify looks at,
+ * goes through here, so once reads are batched this is where the CPU
+ * time goes.  Rather than memcmp() against a second buffer of fill bytes
+ * the kernels below compare against the value broadcast into a register,
+ * OR the differences together and only test the accumulator once per
+ * 256 bytes.  The widest kernel the CPU supports is picked at start-up;
+ * FILLCHECK=generic|sse2|avx2|avx512 in the environment narrows it.
+ *
+ * This file may be redistributed under the terms of the GNU General Public
+ * License, version 2.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fillcheck.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FILLCHECK_X86
+#include <immintrin.h>
+#endif
+
+/* bytes folded into the accumulator between tests */
+#define STRIDE	256
+
+/*
+ * Portable version, eight bytes at a time.  memcpy() keeps the loads
+ * legal for any alignment and compiles to plain moves.
+ */
+static int check_generic(const unsigned char *buf, size_t len,
+		unsigned char val)
+{
+	uint64_t pattern = 0x0101010101010101ULL * val;
+	uint64_t acc, w;
+	size_t i, j;
+
+	for (i = 0; i + STRIDE <= len; i += STRIDE) {
+		acc = 0;
+		for (j = 0; j < STRIDE; j += sizeof(w)) {
+			memcpy(&w, buf + i + j, sizeof(w));
+			acc |= w ^ pattern;
+		}
+		if ( acc )
+			return 0;
+	}
+
+	for (; i < len; i++)
+		if ( buf[i] != val )
+			return 0;
+
+	return 1;
+}
+
+#ifdef FILLCHECK_X86
+__attribute__((target("sse2")))
+static int check_sse2(const unsigned char *buf, size_t len,
+		unsigned char val)
+{
+	__m128i pattern = _mm_set1_epi8((char)val);
+	__m128i zero = _mm_setzero_si128();
+	__m128i acc;
+	size_t i, j;
+
+	for (i = 0; i + STRIDE <= len; i += STRIDE) {
+		acc = zero;
+		for (j = 0; j < STRIDE; j += 16)
+			acc = _mm_or_si128(acc, _mm_xor_si128(pattern,
+				_mm_loadu_si128((const __m128i *)(buf+i+j))));
+		if ( _mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xFFFF )
+			return 0;
+	}
+
+	return check_generic(buf + i, len - i, val);
+}
+
+__attribute__((target("avx2")))
+static int check_avx2(const unsigned char *buf, size_t len,
+		unsigned char val)
+{
+	__m256i pattern = _mm256_set1_epi8((char)val);
+	__m256i acc;
+	size_t i, j;
+
+	for (i = 0; i + STRIDE <= len; i += STRIDE) {
+		acc = _mm256_setzero_si256();
+		for (j = 0; j < STRIDE; j += 32)
+			acc = _mm256_or_si256(acc, _mm256_xor_si256(pattern,
+				_mm256_loadu_si256((const __m256i *)(buf+i+j))));
+		if ( !_mm256_testz_si256(acc, acc) )
+			return 0;
+	}
+
+	return check_generic(buf + i, len - i, val);
+}
+
+__attribute__((target("avx512f")))
+static int check_avx512(const unsigned char *buf, size_t len,
+		unsigned char val)
+{
+	__m512i pattern = _mm512_set1_epi8((char)val);
+	__m512i acc;
+	size_t i, j;
+
+	for (i = 0; i + STRIDE <= len; i += STRIDE) {
+		acc = _mm512_setzero_si512();
+		for (j = 0; j < STRIDE; j += 64)
+			acc = _mm512_or_si512(acc, _mm512_xor_si512(pattern,
+				_mm512_loadu_si512((const void *)(buf+i+j))));
+		if ( _mm512_test_epi64_mask(acc, acc) )
+			return 0;
+	}
+
+	return check_generic(buf + i, len - i, val);
+}
+#endif
+
+static const struct {
+	const char	*name;
+	fill_check_fn	fn;
+} kernels[] = {
+	{ "generic",	check_generic },
+#ifdef FILLCHECK_X86
+	{ "sse2",	check_sse2 },
+	{ "avx2",	check_avx2 },
+	{ "avx512",	check_avx512 },
+#endif
+};
+
+fill_check_fn fill_check_kernel = check_generic;
+static const char *kernel_name = "generic";
+
+static int cpu_has(const char *name)
+{
+#ifdef FILLCHECK_X86
+	__builtin_cpu_init();
+	if ( !strcmp(name, "sse2") )
+		return __builtin_cpu_supports("sse2");
+	if ( !strcmp(name, "avx2") )
+		return __builtin_cpu_supports("avx2");
+	if ( !strcmp(name, "avx512") )
+		return __builtin_cpu_supports("avx512f");
+#endif
+	return !strcmp(name, "generic");
+}
+
+/*
+ * Pick the widest kernel this CPU runs, no wider than $FILLCHECK.
+ * Until this is called the generic kernel is used.
+ */
+void fill_check_init(void)
+{
+	const char *limit = getenv("FILLCHECK");
+	unsigned int i;
+
+	for (i = 0; i < sizeof(kernels)/sizeof(kernels[0]); i++) {
+		if ( !cpu_has(kernels[i].name) )
+			break;
+		fill_check_kernel = kernels[i].fn;
+		kernel_name = kernels[i].name;
+		if ( limit && !strcmp(limit, kernels[i].name) )
+			break;
+	}
+}
+
+const char *fill_check_name(void)
+{
+	return kernel_name;
+}
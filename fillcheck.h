@@ -0,0 +1,26 @@
+/*
+ * fillcheck - test whether a buffer holds nothing but one byte value
+ *
+ * This file may be redistributed under the terms of the GNU General Public
+ * License, version 2.
+ */
+#ifndef ZEROFREE_FILLCHECK_H
+#define ZEROFREE_FILLCHECK_H
+
+#include <stddef.h>
+
+typedef int (*fill_check_fn)(const unsigned char *buf, size_t len,
+		unsigned char val);
+
+extern fill_check_fn fill_check_kernel;
+
+void fill_check_init(void);
+const char *fill_check_name(void);
+
+/* returns non-zero if every byte of buf[0..len-1] equals val */
+static inline int fill_check(const void *buf, size_t len, unsigned char val)
+{
+	return fill_check_kernel((const unsigned char *)buf, len, val);
+}
+
+#endif
@@ -0,0 +1,422 @@
+/*
+ * pipeline - read, check and write stages for zerofree
+ *
+ * The worker thread that owns the pipeline is the reader: it fills the
+ * chunk buffers of a fixed ring in disk order.  opts->checkers threads
+ * scan filled chunks with the fill-value kernel and note the runs of
+ * dirty blocks, and one writer thread takes checked chunks back in ring
+ * order, joins runs that continue from one chunk into the next and
+ * writes them.  The ring holds 2*checkers+2 chunks, which bounds the
+ * memory used, and lets the device and the CPUs work at the same time.
+ *
+ * With opts->ordered the reader and the writer take turns instead, for
+ * disks that would otherwise seek between them: the reader fills the
+ * whole ring, then the writer writes its dirty runs, which are in
+ * ascending order, and hands the device back once the ring is empty.
+ * Only the checkers run alongside the I/O.  The ring is made at least
+ * ORDERED_SWEEP bytes, so each sweep costs only one seek back.
+ *
+ * This file may be redistributed under the terms of the GNU General Public
+ * License, version 2.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "zerofree.h"
+#include "pipeline.h"
+#include "fillcheck.h"
+
+/* least ring size, in bytes, of an ordered pipeline */
+#define ORDERED_SWEEP	(32*1024*1024)
+
+enum { SLOT_FREE, SLOT_FILLED, SLOT_CHECKED };
+
+struct pipe_run {
+	unsigned int	first;		/* block offset within the chunk */
+	unsigned int	len;
+};
+
+struct pipe_slot {
+	unsigned char	*buf;
+	blk64_t		blk;		/* first block of the chunk */
+	unsigned int	count;
+	int		state;
+	unsigned int	nruns;
+	struct pipe_run	*runs;		/* at most count/2+1 of them */
+};
+
+struct pipeline {
+	struct zero_worker	*w;
+	pthread_mutex_t		lock;
+	pthread_cond_t		space;		/* reader waits for a slot */
+	pthread_cond_t		filled;		/* checkers wait for data */
+	pthread_cond_t		checked;	/* writer waits for results */
+	struct pipe_slot	*slots;
+	unsigned int		nslots;
+	unsigned long long	next_read;	/* sequence numbers, the */
+	unsigned long long	next_check;	/* ring slot of each is */
+	unsigned long long	next_write;	/* seq % nslots */
+	int			done;		/* reader has finished */
+	int			drain;		/* reader waits for the writer */
+	int			held;		/* writer holds a run back */
+	int			ordered;	/* reader and writer alternate */
+	int			reading;	/* the reader's turn */
+	int			error;
+	pthread_t		*checkers;
+	unsigned int		ncheckers;	/* threads actually started */
+	pthread_t		writer;
+	int			writer_started;
+	blk64_t			run_start;	/* writer's pending run */
+	blk64_t			run_len;
+};
+
+static void fail(struct pipeline *pipe)
+{
+	pthread_mutex_lock(&pipe->lock);
+	pipe->error = 1;
+	pthread_cond_broadcast(&pipe->space);
+	pthread_cond_broadcast(&pipe->filled);
+	pthread_cond_broadcast(&pipe->checked);
+	pthread_mutex_unlock(&pipe->lock);
+}
+
+static void check_slot(struct pipeline *pipe, struct pipe_slot *slot)
+{
+	const struct zero_opts *opts = pipe->w->opts;
+	unsigned int blocksize = pipe->w->fs->blocksize;
+	blk64_t until = 0, ndirty = 0;
+	unsigned int i, first;
+	int dirty, in_run = 0;
+
+	slot->nruns = 0;
+	for (i = 0; i < slot->count; i++) {
+		dirty = !fill_check(slot->buf + (size_t)i * blocksize,
+					blocksize, opts->fillval);
+		ndirty += dirty;
+		dirty |= slot->blk + i < until;
+		if ( dirty && !in_run ) {
+			first = stripe_start(opts, slot->blk + i, slot->blk) -
+								slot->blk;
+			slot->runs[slot->nruns].first = first;
+			slot->runs[slot->nruns].len = i - first;
+			slot->nruns++;
+		}
+		if ( dirty ) {
+			slot->runs[slot->nruns-1].len++;
+			until = stripe_end(opts, slot->blk + i);
+		}
+		in_run = dirty;
+	}
+
+	worker_dirty(pipe->w, ndirty);
+}
+
+static void *checker_thread(void *arg)
+{
+	struct pipeline *pipe = arg;
+	struct pipe_slot *slot;
+
+	pthread_mutex_lock(&pipe->lock);
+	for (;;) {
+		while ( pipe->next_check == pipe->next_read && !pipe->done &&
+			!pipe->error )
+			pthread_cond_wait(&pipe->filled, &pipe->lock);
+		if ( pipe->error || pipe->next_check == pipe->next_read )
+			break;
+
+		slot = &pipe->slots[pipe->next_check++ % pipe->nslots];
+		pthread_mutex_unlock(&pipe->lock);
+
+		check_slot(pipe, slot);
+
+		pthread_mutex_lock(&pipe->lock);
+		slot->state = SLOT_CHECKED;
+		pthread_cond_broadcast(&pipe->checked);
+	}
+	pthread_mutex_unlock(&pipe->lock);
+
+	return NULL;
+}
+
+static int flush_run(struct pipeline *pipe)
+{
+	struct zero_worker *w = pipe->w;
+
+	if ( !pipe->run_len )
+		return 0;
+
+	worker_modified(w, pipe->run_len);
+	if ( !w->opts->dryrun &&
+		write_fill(w, pipe->run_start, pipe->run_len) ) {
+		fprintf(stderr, "error while writing block\n");
+		return -1;
+	}
+
+	pipe->run_len = 0;
+	return 0;
+}
+
+/*
+ * Add a checked chunk's dirty runs to the pending write.  A run is only
+ * held back while it reaches the end of its chunk, since only then can
+ * the next chunk continue it.
+ */
+static int write_slot(struct pipeline *pipe, struct pipe_slot *slot)
+{
+	blk64_t start;
+	unsigned int i;
+
+	for (i = 0; i < slot->nruns; i++) {
+		start = slot->blk + slot->runs[i].first;
+		if ( pipe->run_len &&
+			start == pipe->run_start + pipe->run_len ) {
+			pipe->run_len += slot->runs[i].len;
+			continue;
+		}
+		if ( flush_run(pipe) )
+			return -1;
+		pipe->run_start = start;
+		pipe->run_len = slot->runs[i].len;
+	}
+
+	if ( pipe->run_start + pipe->run_len != slot->blk + slot->count )
+		return flush_run(pipe);
+
+	return 0;
+}
+
+static void *writer_thread(void *arg)
+{
+	struct pipeline *pipe = arg;
+	struct pipe_slot *slot;
+
+	pthread_mutex_lock(&pipe->lock);
+	for (;;) {
+		slot = &pipe->slots[pipe->next_write % pipe->nslots];
+		while ( (slot->state != SLOT_CHECKED || pipe->reading) &&
+			!pipe->error &&
+			!(pipe->next_write == pipe->next_read &&
+			  (pipe->done || (pipe->drain && pipe->held))) )
+			pthread_cond_wait(&pipe->checked, &pipe->lock);
+		if ( pipe->error || (slot->state != SLOT_CHECKED && pipe->done) )
+			break;
+
+		/* the ring is empty and the reader wants the held run out */
+		if ( slot->state != SLOT_CHECKED ) {
+			pthread_mutex_unlock(&pipe->lock);
+			if ( flush_run(pipe) ) {
+				fail(pipe);
+				return NULL;
+			}
+			pthread_mutex_lock(&pipe->lock);
+			pipe->held = 0;
+			pthread_cond_signal(&pipe->space);
+			continue;
+		}
+		pthread_mutex_unlock(&pipe->lock);
+
+		if ( write_slot(pipe, slot) ) {
+			fail(pipe);
+			return NULL;
+		}
+
+		pthread_mutex_lock(&pipe->lock);
+		pipe->held = pipe->run_len != 0;
+		slot->state = SLOT_FREE;
+		pipe->next_write++;
+		if ( pipe->ordered && pipe->next_write == pipe->next_read )
+			pipe->reading = 1;
+		pthread_cond_signal(&pipe->space);
+	}
+	pthread_mutex_unlock(&pipe->lock);
+
+	if ( !pipe->error && flush_run(pipe) )
+		fail(pipe);
+
+	return NULL;
+}
+
+static void pipeline_free(struct pipeline *pipe)
+{
+	unsigned int i;
+
+	for (i = 0; i < pipe->nslots; i++) {
+		free(pipe->slots[i].buf);
+		free(pipe->slots[i].runs);
+	}
+	free(pipe->slots);
+	free(pipe->checkers);
+	pthread_mutex_destroy(&pipe->lock);
+	pthread_cond_destroy(&pipe->space);
+	pthread_cond_destroy(&pipe->filled);
+	pthread_cond_destroy(&pipe->checked);
+	free(pipe);
+}
+
+struct pipeline *pipeline_new(struct zero_worker *w)
+{
+	const struct zero_opts *opts = w->opts;
+	struct pipeline *pipe;
+	size_t chunk;
+	unsigned int i;
+
+	pipe = calloc(1, sizeof(*pipe));
+	if ( pipe == NULL )
+		return NULL;
+
+	pipe->w = w;
+	pthread_mutex_init(&pipe->lock, NULL);
+	pthread_cond_init(&pipe->space, NULL);
+	pthread_cond_init(&pipe->filled, NULL);
+	pthread_cond_init(&pipe->checked, NULL);
+
+	chunk = (size_t)opts->chunk_blocks * w->fs->blocksize;
+	pipe->nslots = 2 * opts->checkers + 2;
+	if ( opts->ordered ) {
+		pipe->ordered = pipe->reading = 1;
+		if ( pipe->nslots < ORDERED_SWEEP / chunk )
+			pipe->nslots = ORDERED_SWEEP / chunk;
+	}
+	pipe->slots = calloc(pipe->nslots, sizeof(*pipe->slots));
+	pipe->checkers = calloc(opts->checkers, sizeof(*pipe->checkers));
+	if ( pipe->slots == NULL || pipe->checkers == NULL )
+		goto fail;
+
+	for (i = 0; i < pipe->nslots; i++) {
+		pipe->slots[i].buf = malloc(chunk);
+		pipe->slots[i].runs = calloc(opts->chunk_blocks/2 + 1,
+					sizeof(struct pipe_run));
+		if ( pipe->slots[i].buf == NULL ||
+			pipe->slots[i].runs == NULL )
+			goto fail;
+	}
+
+	for (i = 0; i < opts->checkers; i++) {
+		if ( pthread_create(&pipe->checkers[i], NULL, checker_thread,
+					pipe) )
+			break;
+		pipe->ncheckers++;
+	}
+	if ( pipe->ncheckers &&
+		pthread_create(&pipe->writer, NULL, writer_thread, pipe) == 0 )
+		pipe->writer_started = 1;
+
+	if ( !pipe->writer_started ) {
+		pipe->done = 1;
+		fail(pipe);
+		for (i = 0; i < pipe->ncheckers; i++)
+			pthread_join(pipe->checkers[i], NULL);
+		goto fail;
+	}
+
+	return pipe;
+
+fail:
+	pipeline_free(pipe);
+	return NULL;
+}
+
+/*
+ * Give the device to the writer until it has emptied the ring.  Called
+ * with the lock held.
+ */
+static void end_sweep(struct pipeline *pipe)
+{
+	if ( pipe->ordered && pipe->next_write != pipe->next_read ) {
+		pipe->reading = 0;
+		pthread_cond_broadcast(&pipe->checked);
+	}
+}
+
+/*
+ * The reader stage: read the free blocks first .. first+count-1 into the
+ * ring, a chunk at a time, waiting whenever the ring is full.
+ */
+int pipeline_zero_extent(struct pipeline *pipe, blk64_t first,
+		blk64_t count)
+{
+	struct zero_worker *w = pipe->w;
+	struct pipe_slot *slot;
+	blk64_t blk, end, n;
+
+	end = first + count;
+	for (blk = first; blk < end; blk += n) {
+		n = chunk_len(w->opts, blk, end);
+
+		pthread_mutex_lock(&pipe->lock);
+		slot = &pipe->slots[pipe->next_read % pipe->nslots];
+		if ( slot->state != SLOT_FREE )
+			end_sweep(pipe);
+		while ( (slot->state != SLOT_FREE ||
+			(pipe->ordered && !pipe->reading)) && !pipe->error )
+			pthread_cond_wait(&pipe->space, &pipe->lock);
+		pthread_mutex_unlock(&pipe->lock);
+		if ( pipe->error )
+			return -1;
+
+		if ( read_blocks(w, blk, n, slot->buf) ) {
+			fprintf(stderr, "error while reading block\n");
+			fail(pipe);
+			return -1;
+		}
+		worker_scanned(w, n);
+
+		pthread_mutex_lock(&pipe->lock);
+		slot->blk = blk;
+		slot->count = n;
+		slot->state = SLOT_FILLED;
+		pipe->next_read++;
+		pthread_cond_signal(&pipe->filled);
+		pthread_mutex_unlock(&pipe->lock);
+	}
+
+	return 0;
+}
+
+/*
+ * Wait until everything read so far has been checked and written.
+ */
+int pipeline_drain(struct pipeline *pipe)
+{
+	int error;
+
+	pthread_mutex_lock(&pipe->lock);
+	pipe->drain = 1;
+	end_sweep(pipe);
+	pthread_cond_broadcast(&pipe->checked);
+	while ( !pipe->error &&
+		(pipe->next_write != pipe->next_read || pipe->held) )
+		pthread_cond_wait(&pipe->space, &pipe->lock);
+	pipe->drain = 0;
+	error = pipe->error;
+	pthread_mutex_unlock(&pipe->lock);
+
+	return error ? -1 : 0;
+}
+
+/*
+ * Let the checkers and the writer drain the ring, then stop them.
+ */
+int pipeline_finish(struct pipeline *pipe)
+{
+	unsigned int i;
+	int error;
+
+	pthread_mutex_lock(&pipe->lock);
+	pipe->done = 1;
+	end_sweep(pipe);
+	pthread_cond_broadcast(&pipe->filled);
+	pthread_cond_broadcast(&pipe->checked);
+	pthread_mutex_unlock(&pipe->lock);
+
+	for (i = 0; i < pipe->ncheckers; i++)
+		pthread_join(pipe->checkers[i], NULL);
+	pthread_join(pipe->writer, NULL);
+
+	error = pipe->error;
+	pipeline_free(pipe);
+
+	return error ? -1 : 0;
+}
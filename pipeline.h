@@ -0,0 +1,20 @@
+/*
+ * pipeline - read, check and write stages for zerofree
+ *
+ * This file may be redistributed under the terms of the GNU General Public
+ * License, version 2.
+ */
+#ifndef ZEROFREE_PIPELINE_H
+#define ZEROFREE_PIPELINE_H
+
+#include "zerofree.h"
+
+struct pipeline;
+
+struct pipeline *pipeline_new(struct zero_worker *w);
+int pipeline_zero_extent(struct pipeline *pipe, blk64_t first,
+		blk64_t count);
+int pipeline_drain(struct pipeline *pipe);
+int pipeline_finish(struct pipeline *pipe);
+
+#endif
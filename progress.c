@@ -0,0 +1,199 @@
+/*
+ * progress - periodic machine-readable progress for zerofree
+ *
+ * A separate thread wakes every interval, adds up the counters of every
+ * worker and writes one JSON object per line to the given descriptor:
+ * bytes scanned and written, the throughput since the previous line, an
+ * estimate of the time left and the same counters for each thread.  The
+ * last line, written when the run ends, has "done" set.
+ *
+ * This file may be redistributed under the terms of the GNU General Public
+ * License, version 2.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "progress.h"
+
+static double elapsed(const struct progress *prog)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - prog->start.tv_sec) +
+		(now.tv_nsec - prog->start.tv_nsec) / 1e9;
+}
+
+static void slot_counts(const struct progress_slot *slot, blk64_t *scanned,
+		blk64_t *modified)
+{
+	if ( slot->w ) {
+		*scanned = __atomic_load_n(&slot->w->scanned, __ATOMIC_RELAXED);
+		*modified = __atomic_load_n(&slot->w->modified,
+						__ATOMIC_RELAXED);
+	} else {
+		*scanned = slot->scanned;
+		*modified = slot->modified;
+	}
+}
+
+/*
+ * Called with the lock held.
+ */
+static void emit(struct progress *prog, FILE *f, int done)
+{
+	unsigned long long bs = prog->blocksize;
+	blk64_t scanned = 0, modified = 0, s, m;
+	double now, rate, avg;
+	unsigned int i;
+
+	for (i = 0; i < prog->nslots; i++) {
+		slot_counts(&prog->slots[i], &s, &m);
+		scanned += s;
+		modified += m;
+	}
+
+	now = elapsed(prog);
+	rate = now > prog->last_time ? (scanned - prog->last_scanned) * bs /
+					(now - prog->last_time) : 0;
+	avg = now > 0 ? scanned * bs / now : 0;
+	prog->last_time = now;
+	prog->last_scanned = scanned;
+
+	fprintf(f, "{\"elapsed\":%.3f,\"scanned_bytes\":%llu,"
+		"\"written_bytes\":%llu,\"total_bytes\":%llu,",
+		now, (unsigned long long)scanned * bs,
+		(unsigned long long)modified * bs,
+		(unsigned long long)prog->total * bs);
+	fprintf(f, "\"percent\":%.1f,\"mbps\":%.1f,",
+		prog->total ? 100.0 * scanned / prog->total : 100.0,
+		rate / (1024 * 1024));
+	if ( done || scanned >= prog->total )
+		fprintf(f, "\"eta\":0,");
+	else if ( avg > 0 )
+		fprintf(f, "\"eta\":%.1f,",
+			(prog->total - scanned) * bs / avg);
+	else
+		fprintf(f, "\"eta\":null,");
+
+	fprintf(f, "\"threads\":[");
+	for (i = 0; i < prog->nslots; i++) {
+		slot_counts(&prog->slots[i], &s, &m);
+		fprintf(f, "%s{\"scanned_bytes\":%llu,\"written_bytes\":%llu}",
+			i ? "," : "", (unsigned long long)s * bs,
+			(unsigned long long)m * bs);
+	}
+	fprintf(f, "],\"done\":%s}\n", done ? "true" : "false");
+	fflush(f);
+}
+
+static void *progress_thread(void *arg)
+{
+	struct progress *prog = arg;
+	struct timespec deadline;
+	FILE *f;
+	int fd;
+
+	/* a FILE of our own, so closing it leaves the caller's fd open */
+	fd = dup(prog->fd);
+	f = fd < 0 ? NULL : fdopen(fd, "w");
+	if ( f == NULL ) {
+		fprintf(stderr, "cannot write progress to fd %d\n", prog->fd);
+		if ( fd >= 0 )
+			close(fd);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&prog->lock);
+	while ( !prog->stop ) {
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += (time_t)prog->interval;
+		deadline.tv_nsec += (long)((prog->interval -
+				(time_t)prog->interval) * 1e9);
+		if ( deadline.tv_nsec >= 1000000000 ) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+
+		while ( !prog->stop && pthread_cond_timedwait(&prog->wake,
+					&prog->lock, &deadline) == 0 )
+			;
+		emit(prog, f, prog->stop);
+	}
+	pthread_mutex_unlock(&prog->lock);
+
+	fclose(f);
+	return NULL;
+}
+
+int progress_start(struct progress *prog, int fd, double interval,
+		blk64_t total, unsigned int blocksize, unsigned int nslots)
+{
+	pthread_condattr_t attr;
+
+	memset(prog, 0, sizeof(*prog));
+	prog->fd = fd;
+	prog->interval = interval;
+	prog->total = total;
+	prog->blocksize = blocksize;
+	prog->nslots = nslots;
+	prog->slots = calloc(nslots, sizeof(*prog->slots));
+	if ( prog->slots == NULL )
+		return -1;
+
+	pthread_mutex_init(&prog->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&prog->wake, &attr);
+	pthread_condattr_destroy(&attr);
+	clock_gettime(CLOCK_MONOTONIC, &prog->start);
+
+	if ( pthread_create(&prog->thread, NULL, progress_thread, prog) ) {
+		free(prog->slots);
+		return -1;
+	}
+
+	return 0;
+}
+
+void progress_attach(struct progress *prog, struct zero_worker *w,
+		unsigned int slot)
+{
+	pthread_mutex_lock(&prog->lock);
+	prog->slots[slot].w = w;
+	pthread_mutex_unlock(&prog->lock);
+}
+
+/*
+ * Keep the worker's final counts; it is about to go away.
+ */
+void progress_detach(struct progress *prog, unsigned int slot)
+{
+	struct progress_slot *s = &prog->slots[slot];
+
+	pthread_mutex_lock(&prog->lock);
+	if ( s->w ) {
+		s->scanned = s->w->scanned;
+		s->modified = s->w->modified;
+		s->w = NULL;
+	}
+	pthread_mutex_unlock(&prog->lock);
+}
+
+/*
+ * Write the final line and stop the thread.
+ */
+void progress_stop(struct progress *prog)
+{
+	pthread_mutex_lock(&prog->lock);
+	prog->stop = 1;
+	pthread_cond_signal(&prog->wake);
+	pthread_mutex_unlock(&prog->lock);
+
+	pthread_join(prog->thread, NULL);
+	pthread_mutex_destroy(&prog->lock);
+	pthread_cond_destroy(&prog->wake);
+	free(prog->slots);
+}
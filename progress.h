@@ -0,0 +1,44 @@
+/*
+ * progress - periodic machine-readable progress for zerofree
+ *
+ * This file may be redistributed under the terms of the GNU General Public
+ * License, version 2.
+ */
+#ifndef ZEROFREE_PROGRESS_H
+#define ZEROFREE_PROGRESS_H
+
+#include <time.h>
+#include <pthread.h>
+
+#include "zerofree.h"
+
+struct progress_slot {
+	struct zero_worker	*w;		/* NULL once detached */
+	blk64_t			scanned;	/* final counts after that */
+	blk64_t			modified;
+};
+
+struct progress {
+	int			fd;
+	double			interval;	/* seconds between lines */
+	blk64_t			total;		/* free blocks planned */
+	unsigned int		blocksize;
+	struct progress_slot	*slots;		/* one per worker thread */
+	unsigned int		nslots;
+	pthread_mutex_t		lock;
+	pthread_cond_t		wake;
+	int			stop;
+	pthread_t		thread;
+	struct timespec		start;
+	double			last_time;	/* of the previous line */
+	blk64_t			last_scanned;
+};
+
+int progress_start(struct progress *prog, int fd, double interval,
+		blk64_t total, unsigned int blocksize, unsigned int nslots);
+void progress_attach(struct progress *prog, struct zero_worker *w,
+		unsigned int slot);
+void progress_detach(struct progress *prog, unsigned int slot);
+void progress_stop(struct progress *prog);
+
+#endif
@@ -0,0 +1,142 @@
+/*
+ * ratelimit - bandwidth and IOPS limits shared by every worker
+ *
+ * Each limit is a token bucket that fills at the permitted rate and holds
+ * at most a tenth of a second's worth.  Every request takes its cost out
+ * before it is issued; if that leaves the bucket in debt, the caller
+ * sleeps until the debt would be paid off.  Later callers see the debt
+ * left by earlier ones, so the requests of all threads are spaced out
+ * evenly however large each of them is.
+ *
+ * This file may be redistributed under the terms of the GNU General Public
+ * License, version 2.
+ */
+#include <errno.h>
+
+#include "ratelimit.h"
+
+/* how far ahead of the rate an idle bucket lets a burst run */
+#define BURST_SECONDS	0.1
+
+static void bucket_init(struct token_bucket *b, double rate)
+{
+	b->rate = rate;
+	b->tokens = rate * BURST_SECONDS;
+}
+
+static void refill(struct token_bucket *b, double elapsed)
+{
+	if ( !b->rate )
+		return;
+
+	b->tokens += b->rate * elapsed;
+	if ( b->tokens > b->rate * BURST_SECONDS )
+		b->tokens = b->rate * BURST_SECONDS;
+}
+
+/*
+ * Returns the seconds to wait before the request may go out.
+ */
+static double take(struct token_bucket *b, double cost)
+{
+	if ( !b->rate )
+		return 0;
+
+	b->tokens -= cost;
+	return b->tokens < 0 ? -b->tokens / b->rate : 0;
+}
+
+/*
+ * Charge one request, and bytes against b if it is not NULL, then wait
+ * for whichever limit is furthest behind.
+ */
+static void charge(struct rate_limit *rl, struct token_bucket *b,
+		unsigned long long bytes)
+{
+	struct timespec now;
+	double wait, ops_wait, adapt_wait;
+	long long nsec;
+
+	pthread_mutex_lock(&rl->lock);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	nsec = (now.tv_sec - rl->last.tv_sec) * 1000000000LL +
+		(now.tv_nsec - rl->last.tv_nsec);
+	rl->last = now;
+
+	refill(&rl->read, nsec / 1e9);
+	refill(&rl->write, nsec / 1e9);
+	refill(&rl->iops, nsec / 1e9);
+	refill(&rl->adapt, nsec / 1e9);
+
+	wait = b ? take(b, bytes) : 0;
+	ops_wait = take(&rl->iops, 1);
+	if ( ops_wait > wait )
+		wait = ops_wait;
+	adapt_wait = take(&rl->adapt, 1);
+	if ( adapt_wait > wait )
+		wait = adapt_wait;
+	pthread_mutex_unlock(&rl->lock);
+
+	if ( wait <= 0 )
+		return;
+
+	nsec = now.tv_nsec + (long long)(wait * 1e9);
+	now.tv_sec += nsec / 1000000000;
+	now.tv_nsec = nsec % 1000000000;
+	while ( clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &now,
+				NULL) == EINTR )
+		;
+}
+
+/*
+ * A rate of 0 leaves that limit off.
+ */
+void rate_init(struct rate_limit *rl, double read_bps, double write_bps,
+		double iops)
+{
+	bucket_init(&rl->read, read_bps);
+	bucket_init(&rl->write, write_bps);
+	bucket_init(&rl->iops, iops);
+	bucket_init(&rl->adapt, 0);
+	clock_gettime(CLOCK_MONOTONIC, &rl->last);
+	pthread_mutex_init(&rl->lock, NULL);
+}
+
+void rate_read(struct rate_limit *rl, unsigned long long bytes)
+{
+	charge(rl, &rl->read, bytes);
+}
+
+void rate_write(struct rate_limit *rl, unsigned long long bytes)
+{
+	charge(rl, &rl->write, bytes);
+}
+
+/*
+ * A request that moves no data, such as a discard, only counts against
+ * the IOPS limit.
+ */
+void rate_op(struct rate_limit *rl)
+{
+	charge(rl, NULL, 0);
+}
+
+/*
+ * Change the request cap that sits on top of the user's limits; 0 lifts
+ * it.  Debt run up under the old rate is kept.
+ */
+void rate_adapt(struct rate_limit *rl, double iops)
+{
+	pthread_mutex_lock(&rl->lock);
+	if ( !rl->adapt.rate || !iops )
+		rl->adapt.tokens = iops * BURST_SECONDS;
+	rl->adapt.rate = iops;
+	if ( rl->adapt.tokens > iops * BURST_SECONDS )
+		rl->adapt.tokens = iops * BURST_SECONDS;
+	pthread_mutex_unlock(&rl->lock);
+}
+
+void rate_free(struct rate_limit *rl)
+{
+	pthread_mutex_destroy(&rl->lock);
+}
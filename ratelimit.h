@@ -0,0 +1,35 @@
+/*
+ * ratelimit - bandwidth and IOPS limits shared by every worker
+ *
+ * This file may be redistributed under the terms of the GNU General Public
+ * License, version 2.
+ */
+#ifndef ZEROFREE_RATELIMIT_H
+#define ZEROFREE_RATELIMIT_H
+
+#include <time.h>
+#include <pthread.h>
+
+struct token_bucket {
+	double		rate;		/* tokens per second, 0 = no limit */
+	double		tokens;		/* negative while in debt */
+};
+
+struct rate_limit {
+	struct token_bucket	read;		/* bytes */
+	struct token_bucket	write;		/* bytes */
+	struct token_bucket	iops;		/* requests */
+	struct token_bucket	adapt;		/* requests, set by throttle.c */
+	struct timespec		last;		/* of the last refill */
+	pthread_mutex_t		lock;
+};
+
+void rate_init(struct rate_limit *rl, double read_bps, double write_bps,
+		double iops);
+void rate_read(struct rate_limit *rl, unsigned long long bytes);
+void rate_write(struct rate_limit *rl, unsigned long long bytes);
+void rate_op(struct rate_limit *rl);
+void rate_adapt(struct rate_limit *rl, double iops);
+void rate_free(struct rate_limit *rl);
+
+#endif
@@ -0,0 +1,275 @@
+/*
+ * report - per-group account of free and dirty blocks
+ *
+ * Workers note every free extent they visit and how many of its blocks
+ * did not hold the fill value.  At the end the totals, a histogram of
+ * free run lengths and the per-group counts are written as JSON or CSV,
+ * which with -n tells how much an image would gain from zeroing before
+ * any I/O is spent on it.
+ *
+ * Workers visit one block group at a time, but a free run may go on
+ * into the next group, so the runs touching either end of a group are
+ * set aside and joined to their neighbours before they are counted.
+ *
+ * This file may be redistributed under the terms of the GNU General Public
+ * License, version 2.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "report.h"
+
+int report_init(struct report *rep, ext2_filsys fs)
+{
+	dgrp_t group;
+
+	memset(rep, 0, sizeof(*rep));
+	rep->fs = fs;
+	rep->ngroups = fs->group_desc_count;
+	rep->free = calloc(rep->ngroups, sizeof(*rep->free));
+	rep->dirty = calloc(rep->ngroups, sizeof(*rep->dirty));
+	rep->head = calloc(rep->ngroups, sizeof(*rep->head));
+	rep->tail = calloc(rep->ngroups, sizeof(*rep->tail));
+	if ( rep->free == NULL || rep->dirty == NULL || rep->head == NULL ||
+		rep->tail == NULL ) {
+		report_free(rep);
+		return -1;
+	}
+
+	/* groups no worker visits keep the descriptor's count */
+	for (group = 0; group < rep->ngroups; group++)
+		rep->free[group] = ext2fs_bg_free_blocks_count(fs, group);
+
+	pthread_mutex_init(&rep->lock, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &rep->start);
+	return 0;
+}
+
+/*
+ * The group counters belong to the worker visiting the group, so only
+ * the shared histogram needs the lock.
+ */
+void report_group_start(struct report *rep, dgrp_t group)
+{
+	rep->free[group] = 0;
+	rep->dirty[group] = 0;
+	rep->head[group] = 0;
+	rep->tail[group] = 0;
+}
+
+static void count_run(struct report *rep, blk64_t count)
+{
+	if ( count )
+		rep->runs[63 - __builtin_clzll(count)]++;
+}
+
+/*
+ * Note the free extent first .. first+count-1, which lies in group.
+ */
+void report_extent(struct report *rep, dgrp_t group, blk64_t first,
+		blk64_t count)
+{
+	int edge = 0;
+
+	rep->free[group] += count;
+
+	if ( first == ext2fs_group_first_block2(rep->fs, group) ) {
+		rep->head[group] = count;
+		edge = 1;
+	}
+	if ( first + count - 1 == ext2fs_group_last_block2(rep->fs, group) ) {
+		rep->tail[group] = count;
+		edge = 1;
+	}
+	if ( edge )
+		return;
+
+	pthread_mutex_lock(&rep->lock);
+	count_run(rep, count);
+	pthread_mutex_unlock(&rep->lock);
+}
+
+/*
+ * Count the runs set aside at group edges, joining each group's tail to
+ * the next group's head.  A group that is free from end to end carries
+ * the run on into the one after it.  A group no worker visited has no
+ * edges, so it ends the run.
+ */
+static void join_edges(struct report *rep)
+{
+	blk64_t run = 0, size;
+	dgrp_t group;
+
+	for (group = 0; group < rep->ngroups; group++) {
+		size = ext2fs_group_last_block2(rep->fs, group) -
+			ext2fs_group_first_block2(rep->fs, group) + 1;
+		if ( rep->head[group] == size ) {
+			run += size;
+			continue;
+		}
+		count_run(rep, run + rep->head[group]);
+		run = rep->tail[group];
+	}
+	count_run(rep, run);
+}
+
+void report_dirty(struct report *rep, dgrp_t group, blk64_t count)
+{
+	rep->dirty[group] += count;
+}
+
+static void json_string(FILE *f, const char *s)
+{
+	fputc('"', f);
+	for (; *s; s++) {
+		if ( *s == '"' || *s == '\\' )
+			fputc('\\', f);
+		if ( (unsigned char)*s < 0x20 )
+			fprintf(f, "\\u%04x", *s);
+		else
+			fputc(*s, f);
+	}
+	fputc('"', f);
+}
+
+static void write_json(FILE *f, struct report *rep, ext2_filsys fs,
+		const struct zero_opts *opts, double elapsed,
+		blk64_t free_blocks, blk64_t dirty)
+{
+	unsigned int i;
+	dgrp_t group;
+	const char *sep = "";
+
+	fprintf(f, "{\n  \"device\": ");
+	json_string(f, opts->device);
+	fprintf(f, ",\n  \"block_size\": %u,\n", fs->blocksize);
+	fprintf(f, "  \"fill_value\": %u,\n", opts->fillval);
+	fprintf(f, "  \"dry_run\": %s,\n", opts->dryrun ? "true" : "false");
+	fprintf(f, "  \"elapsed_seconds\": %.3f,\n", elapsed);
+	fprintf(f, "  \"total_blocks\": %llu,\n",
+		(unsigned long long)ext2fs_blocks_count(fs->super));
+	fprintf(f, "  \"free_blocks\": %llu,\n",
+		(unsigned long long)free_blocks);
+	fprintf(f, "  \"dirty_free_blocks\": %llu,\n",
+		(unsigned long long)dirty);
+	fprintf(f, "  \"dirty_bytes\": %llu,\n",
+		(unsigned long long)dirty * fs->blocksize);
+	fprintf(f, "  \"reclaimable_bytes\": %llu,\n",
+		(unsigned long long)free_blocks * fs->blocksize);
+
+	fprintf(f, "  \"free_runs\": [");
+	for (i = 0; i < REPORT_BUCKETS; i++) {
+		if ( !rep->runs[i] )
+			continue;
+		fprintf(f, "%s\n    { \"min_blocks\": %llu, \"max_blocks\":"
+			" %llu, \"count\": %llu }", sep, 1ULL << i,
+			(2ULL << i) - 1, (unsigned long long)rep->runs[i]);
+		sep = ",";
+	}
+	fprintf(f, "\n  ],\n");
+
+	sep = "";
+	fprintf(f, "  \"groups\": [");
+	for (group = 0; group < rep->ngroups; group++) {
+		fprintf(f, "%s\n    { \"group\": %u, \"free_blocks\": %llu,"
+			" \"dirty_free_blocks\": %llu }", sep, group,
+			(unsigned long long)rep->free[group],
+			(unsigned long long)rep->dirty[group]);
+		sep = ",";
+	}
+	fprintf(f, "\n  ]\n}\n");
+}
+
+/*
+ * CSV has no nesting, so the groups, the run histogram and the totals
+ * follow each other as three tables separated by blank lines.
+ */
+static void write_csv(FILE *f, struct report *rep, ext2_filsys fs,
+		const struct zero_opts *opts, double elapsed,
+		blk64_t free_blocks, blk64_t dirty)
+{
+	unsigned int i;
+	dgrp_t group;
+
+	fprintf(f, "group,free_blocks,dirty_free_blocks\n");
+	for (group = 0; group < rep->ngroups; group++)
+		fprintf(f, "%u,%llu,%llu\n", group,
+			(unsigned long long)rep->free[group],
+			(unsigned long long)rep->dirty[group]);
+
+	fprintf(f, "\nmin_blocks,max_blocks,count\n");
+	for (i = 0; i < REPORT_BUCKETS; i++)
+		if ( rep->runs[i] )
+			fprintf(f, "%llu,%llu,%llu\n", 1ULL << i,
+				(2ULL << i) - 1,
+				(unsigned long long)rep->runs[i]);
+
+	fprintf(f, "\nkey,value\n");
+	fprintf(f, "block_size,%u\n", fs->blocksize);
+	fprintf(f, "fill_value,%u\n", opts->fillval);
+	fprintf(f, "dry_run,%d\n", opts->dryrun);
+	fprintf(f, "elapsed_seconds,%.3f\n", elapsed);
+	fprintf(f, "total_blocks,%llu\n",
+		(unsigned long long)ext2fs_blocks_count(fs->super));
+	fprintf(f, "free_blocks,%llu\n", (unsigned long long)free_blocks);
+	fprintf(f, "dirty_free_blocks,%llu\n", (unsigned long long)dirty);
+	fprintf(f, "dirty_bytes,%llu\n",
+		(unsigned long long)dirty * fs->blocksize);
+	fprintf(f, "reclaimable_bytes,%llu\n",
+		(unsigned long long)free_blocks * fs->blocksize);
+}
+
+/*
+ * Write the report to path, or to stdout for "-".  Reclaimable bytes are
+ * those a sparse copy can leave out once every free block is zeroed.
+ */
+int report_write(struct report *rep, ext2_filsys fs,
+		const struct zero_opts *opts, const char *path, int csv)
+{
+	struct timespec now;
+	blk64_t free_blocks = 0, dirty = 0;
+	double elapsed;
+	dgrp_t group;
+	FILE *f;
+	int ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = (now.tv_sec - rep->start.tv_sec) +
+		(now.tv_nsec - rep->start.tv_nsec) / 1e9;
+
+	for (group = 0; group < rep->ngroups; group++) {
+		free_blocks += rep->free[group];
+		dirty += rep->dirty[group];
+	}
+	join_edges(rep);
+
+	f = strcmp(path, "-") ? fopen(path, "w") : stdout;
+	if ( f == NULL ) {
+		fprintf(stderr, "failed to write report %s\n", path);
+		return -1;
+	}
+
+	if ( csv )
+		write_csv(f, rep, fs, opts, elapsed, free_blocks, dirty);
+	else
+		write_json(f, rep, fs, opts, elapsed, free_blocks, dirty);
+
+	ret = fflush(f);
+	if ( f != stdout )
+		ret |= fclose(f);
+	if ( ret ) {
+		fprintf(stderr, "failed to write report %s\n", path);
+		return -1;
+	}
+
+	return 0;
+}
+
+void report_free(struct report *rep)
+{
+	free(rep->free);
+	free(rep->dirty);
+	free(rep->head);
+	free(rep->tail);
+}
@@ -0,0 +1,38 @@
+/*
+ * report - per-group account of free and dirty blocks
+ *
+ * This file may be redistributed under the terms of the GNU General Public
+ * License, version 2.
+ */
+#ifndef ZEROFREE_REPORT_H
+#define ZEROFREE_REPORT_H
+
+#include <time.h>
+#include <pthread.h>
+
+#include "zerofree.h"
+
+#define REPORT_BUCKETS	64	/* free runs by log2 of their length */
+
+struct report {
+	ext2_filsys	fs;
+	dgrp_t		ngroups;
+	blk64_t		*free;		/* free blocks per group */
+	blk64_t		*dirty;		/* of which not holding the fill */
+	blk64_t		*head;		/* free run at the group's start */
+	blk64_t		*tail;		/* free run at the group's end */
+	blk64_t		runs[REPORT_BUCKETS];
+	pthread_mutex_t	lock;		/* for runs */
+	struct timespec	start;
+};
+
+int report_init(struct report *rep, ext2_filsys fs);
+void report_group_start(struct report *rep, dgrp_t group);
+void report_extent(struct report *rep, dgrp_t group, blk64_t first,
+		blk64_t count);
+void report_dirty(struct report *rep, dgrp_t group, blk64_t count);
+int report_write(struct report *rep, ext2_filsys fs,
+		const struct zero_opts *opts, const char *path, int csv);
+void report_free(struct report *rep);
+
+#endif
@@ -10,6 +10,9 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdlib.h>
+
+#include "fillcheck.h"
 
 #define USAGE "usage: %s [-n] [-v] filesystem filename ...\n"
 
@@ -41,7 +44,7 @@ static int process(ext2_filsys fs, blk_t *blocknr, e2_blkcnt_t blockcnt,
 {
 	struct process_data *p;
 	errcode_t errcode;
-	int i, group;
+	int group;
 	int ret = 0;
 
 	p = (struct process_data *)priv;
@@ -53,13 +56,7 @@ static int process(ext2_filsys fs, blk_t *blocknr, e2_blkcnt_t blockcnt,
 			return BLOCK_ABORT;
 		}
 
-		for ( i=0; i < fs->blocksize; ++i ) {
-			if ( p->buf[i] ) {
-				break;
-			}
-		}
-
-		if ( i == fs->blocksize ) {
+		if ( fill_check(p->buf, fs->blocksize, 0) ) {
 			p->count++;
 
 			if ( !p->dryrun ) {
@@ -161,6 +158,8 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
+	fill_check_init();
+
 	ret = ext2fs_read_inode_bitmap(fs);
 	if ( ret ) {
 		fprintf(stderr, "%s: error while reading inode bitmap\n", argv[0]);
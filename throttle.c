@@ -0,0 +1,167 @@
+/*
+ * throttle - back off when the device's latency rises
+ *
+ * Every I/O is timed from issue to completion.  After a window of
+ * completions the 99th percentile is compared with the target.  Above
+ * it, the number of I/Os allowed in flight is halved.  Once that is down
+ * to one, the request rate is capped at 70% of what the window managed.
+ * Below half the target the device is taken to have room to spare, and
+ * the same steps are retraced: the cap is raised by a quarter and dropped
+ * once it no longer holds anything back, then concurrency grows by one
+ * per window until it is back where it started.
+ *
+ * This file may be redistributed under the terms of the GNU General Public
+ * License, version 2.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "throttle.h"
+
+/* shortest window, and fewest completions worth deciding on */
+#define WINDOW_SECONDS	0.25
+#define MIN_SAMPLES	16
+
+static double seconds(const struct timespec *from, const struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) +
+		(to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Called with the lock held at the end of a window.
+ */
+static void adjust(struct throttle *th, double elapsed)
+{
+	double p99, done;
+
+	qsort(th->lat, th->samples, sizeof(*th->lat), cmp_double);
+	p99 = th->lat[(th->samples * 99 + 99) / 100 - 1];
+	done = th->samples / elapsed;
+
+	if ( p99 > th->target ) {
+		if ( th->limit > 1 ) {
+			th->limit /= 2;
+		} else {
+			th->iops = (th->iops ? th->iops : done) * 0.7;
+			if ( th->iops < 1 )
+				th->iops = 1;
+			rate_adapt(th->rate, th->iops);
+		}
+	} else if ( p99 < th->target / 2 ) {
+		if ( th->iops ) {
+			th->iops = done < th->iops / 2 ? 0 : th->iops * 1.25;
+			rate_adapt(th->rate, th->iops);
+		} else if ( th->limit < th->max_limit ) {
+			th->limit++;
+			pthread_cond_broadcast(&th->room);
+		}
+	}
+}
+
+void throttle_init(struct throttle *th, double target,
+		unsigned int max_limit, struct rate_limit *rate)
+{
+	memset(th, 0, sizeof(*th));
+	th->target = target;
+	th->limit = th->max_limit = max_limit ? max_limit : 1;
+	th->rate = rate;
+	clock_gettime(CLOCK_MONOTONIC, &th->window);
+	pthread_mutex_init(&th->lock, NULL);
+	pthread_cond_init(&th->room, NULL);
+}
+
+/*
+ * Change the most I/Os that may be in flight, once it is known how many
+ * the run will have.  A limit already lowered below it is kept.
+ */
+void throttle_resize(struct throttle *th, unsigned int max_limit)
+{
+	pthread_mutex_lock(&th->lock);
+	th->max_limit = max_limit ? max_limit : 1;
+	if ( th->limit > th->max_limit )
+		th->limit = th->max_limit;
+	pthread_mutex_unlock(&th->lock);
+}
+
+/*
+ * Wait until another I/O may be issued and note when it was.
+ */
+void throttle_begin(struct throttle *th, struct timespec *start)
+{
+	pthread_mutex_lock(&th->lock);
+	while ( th->inflight >= th->limit )
+		pthread_cond_wait(&th->room, &th->lock);
+	th->inflight++;
+	pthread_mutex_unlock(&th->lock);
+
+	clock_gettime(CLOCK_MONOTONIC, start);
+}
+
+/*
+ * As throttle_begin(), but returns 0 rather than wait, for callers that
+ * must reap their own completions to make room.
+ */
+int throttle_try_begin(struct throttle *th, struct timespec *start)
+{
+	int ok;
+
+	pthread_mutex_lock(&th->lock);
+	ok = th->inflight < th->limit;
+	if ( ok )
+		th->inflight++;
+	pthread_mutex_unlock(&th->lock);
+
+	if ( ok )
+		clock_gettime(CLOCK_MONOTONIC, start);
+	return ok;
+}
+
+/*
+ * Time an I/O that has to go out regardless, such as the writes a
+ * completed read calls for.  It still counts against the limit.
+ */
+void throttle_enter(struct throttle *th, struct timespec *start)
+{
+	pthread_mutex_lock(&th->lock);
+	th->inflight++;
+	pthread_mutex_unlock(&th->lock);
+
+	clock_gettime(CLOCK_MONOTONIC, start);
+}
+
+void throttle_end(struct throttle *th, const struct timespec *start)
+{
+	struct timespec now;
+	double elapsed;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	pthread_mutex_lock(&th->lock);
+	th->inflight--;
+	th->lat[th->samples++] = seconds(start, &now);
+
+	elapsed = seconds(&th->window, &now);
+	if ( th->samples == THROTTLE_SAMPLES ||
+		(elapsed >= WINDOW_SECONDS && th->samples >= MIN_SAMPLES) ) {
+		adjust(th, elapsed);
+		th->samples = 0;
+		th->window = now;
+	}
+
+	pthread_cond_signal(&th->room);
+	pthread_mutex_unlock(&th->lock);
+}
+
+void throttle_free(struct throttle *th)
+{
+	pthread_mutex_destroy(&th->lock);
+	pthread_cond_destroy(&th->room);
+}
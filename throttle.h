@@ -0,0 +1,41 @@
+/*
+ * throttle - back off when the device's latency rises
+ *
+ * This file may be redistributed under the terms of the GNU General Public
+ * License, version 2.
+ */
+#ifndef ZEROFREE_THROTTLE_H
+#define ZEROFREE_THROTTLE_H
+
+#include <time.h>
+#include <pthread.h>
+
+#include "ratelimit.h"
+
+/* most completions looked at before the limits are reconsidered */
+#define THROTTLE_SAMPLES	1024
+
+struct throttle {
+	double			target;		/* p99 latency goal, seconds */
+	unsigned int		limit;		/* I/Os allowed in flight */
+	unsigned int		max_limit;
+	unsigned int		inflight;
+	double			iops;		/* request cap, 0 = none */
+	struct rate_limit	*rate;		/* where the cap applies */
+	double			lat[THROTTLE_SAMPLES];
+	unsigned int		samples;	/* in this window */
+	struct timespec		window;		/* start of this window */
+	pthread_mutex_t		lock;
+	pthread_cond_t		room;
+};
+
+void throttle_init(struct throttle *th, double target,
+		unsigned int max_limit, struct rate_limit *rate);
+void throttle_resize(struct throttle *th, unsigned int max_limit);
+void throttle_begin(struct throttle *th, struct timespec *start);
+int throttle_try_begin(struct throttle *th, struct timespec *start);
+void throttle_enter(struct throttle *th, struct timespec *start);
+void throttle_end(struct throttle *th, const struct timespec *start);
+void throttle_free(struct throttle *th);
+
+#endif
@@ -0,0 +1,601 @@
+/*
+ * uring - io_uring engine for zerofree
+ *
+ * Keeps up to queue_depth chunk reads in flight across free extents.
+ * Each completed chunk is checked against the fill value and the dirty
+ * runs it contains are written back asynchronously, with every iovec
+ * pointing at the shared empty block.
+ *
+ * Completions are only collected while waiting; completed reads are put
+ * on a list and checked once the wait is over.  Queueing their writes
+ * may itself have to wait for room in the ring, and that way it never
+ * ends up checking another chunk half way through.
+ *
+ * This file may be redistributed under the terms of the GNU General Public
+ * License, version 2.
+ */
+#include <liburing.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <linux/falloc.h>
+
+#include "zerofree.h"
+#include "uring.h"
+#include "fillcheck.h"
+#include "ratelimit.h"
+#include "throttle.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/*
+ * One per request in flight, so each is timed from its own issue.  The
+ * read or discard of a slot and the writes that follow it have one each.
+ * A read or write that comes back short is sent again for the blocks it
+ * has not done.
+ */
+struct uring_op {
+	struct uring_slot	*slot;
+	unsigned long long	off;		/* bytes left to read or write */
+	unsigned int		len;
+	struct timespec		issued;
+	struct uring_op		*next;		/* retry list */
+};
+
+struct uring_slot {
+	unsigned char		*buf;		/* chunk_blocks blocks */
+	unsigned int		index;		/* registered buffer index */
+	blk64_t			blk;		/* first block of the chunk */
+	unsigned int		count;		/* blocks in the chunk */
+	int			reading;	/* read still in flight */
+	int			ready;		/* read done, writes to queue */
+	int			discard;	/* pending ops are discards */
+	unsigned int		pending;	/* writes/discards in flight */
+	struct uring_op		*ops;		/* max_ops of them */
+	unsigned int		nops;		/* used since get_slot() */
+	struct uring_slot	*next;		/* free or ready list */
+};
+
+struct uring_engine {
+	struct io_uring		ring;
+	struct zero_worker	*w;
+	ext2_filsys		fs;
+	const struct zero_opts	*opts;
+	int			fd;		/* fd, or 0 for the fixed file */
+	int			fixed_file;
+	int			fixed_bufs;
+	struct uring_slot	*slots;
+	unsigned int		max_ops;	/* per slot */
+	struct uring_op		*ops;
+	struct uring_slot	*free;
+	struct uring_slot	*ready;		/* reads waiting to be checked */
+	struct uring_op		*retry;		/* short transfers to resend */
+	unsigned int		busy;		/* slots off the free list */
+	unsigned char		*bufs;
+	struct iovec		*fill_iov;	/* IOV_MAX x the empty block */
+	int			error;
+};
+
+static void collect(struct uring_engine *eng, int wait);
+
+/*
+ * Get an SQE, submitting the queue when it is full.  The kernel refuses
+ * to take more while completions it has no room for are waiting, so
+ * they are collected first.  Returns NULL if the ring has failed.
+ */
+static struct io_uring_sqe *get_sqe(struct uring_engine *eng)
+{
+	struct io_uring_sqe *sqe;
+	int ret;
+
+	while ( (sqe = io_uring_get_sqe(&eng->ring)) == NULL ) {
+		ret = io_uring_submit(&eng->ring);
+		if ( ret == -EBUSY || ret == -EAGAIN ) {
+			collect(eng, 1);
+		} else if ( ret < 0 && ret != -EINTR ) {
+			fprintf(stderr, "io_uring submit failed: %s\n",
+				strerror(-ret));
+			eng->error = 1;
+			return NULL;
+		}
+	}
+
+	return sqe;
+}
+
+static struct uring_op *get_op(struct uring_slot *slot,
+		unsigned long long off, unsigned int len)
+{
+	struct uring_op *op = &slot->ops[slot->nops++];
+
+	op->slot = slot;
+	op->off = off;
+	op->len = len;
+	return op;
+}
+
+static void prep_common(struct uring_engine *eng, struct io_uring_sqe *sqe,
+		struct uring_op *op)
+{
+	if ( eng->fixed_file )
+		sqe->flags |= IOSQE_FIXED_FILE;
+	io_uring_sqe_set_data(sqe, op);
+}
+
+/*
+ * Prepare the read of a slot that is reading, or else a write of the
+ * fill value, for what op has left.  A write resent from the middle of
+ * a block finishes that block on its own first.
+ */
+static void prep_op(struct uring_engine *eng, struct io_uring_sqe *sqe,
+		struct uring_op *op)
+{
+	struct uring_slot *slot = op->slot;
+	unsigned int blocksize = eng->fs->blocksize;
+	unsigned int part = op->off % blocksize;
+	unsigned char *buf;
+
+	buf = slot->buf + (op->off - (unsigned long long)slot->blk * blocksize);
+	if ( !slot->reading && part )
+		io_uring_prep_write(sqe, eng->fd, eng->opts->empty,
+			blocksize - part, op->off);
+	else if ( !slot->reading )
+		io_uring_prep_writev(sqe, eng->fd, eng->fill_iov,
+			op->len / blocksize, op->off);
+	else if ( eng->fixed_bufs )
+		io_uring_prep_read_fixed(sqe, eng->fd, buf, op->len, op->off,
+			slot->index);
+	else
+		io_uring_prep_read(sqe, eng->fd, buf, op->len, op->off);
+	prep_common(eng, sqe, op);
+}
+
+/*
+ * Queue a writev for each run of blocks in a completed chunk that does
+ * not hold the fill value.
+ */
+static void queue_writes(struct uring_engine *eng, struct uring_slot *slot)
+{
+	const struct zero_opts *opts = eng->opts;
+	ext2_filsys fs = eng->fs;
+	struct io_uring_sqe *sqe;
+	struct uring_op *op;
+	unsigned int i, run, run_len, start = 0, floor;
+	blk64_t until = 0, ndirty = 0;
+	int dirty, ended;
+
+	run = run_len = floor = 0;
+	for (i = 0; i <= slot->count; i++) {
+		dirty = i < slot->count &&
+			!fill_check(slot->buf + (size_t)i * fs->blocksize,
+				fs->blocksize, opts->fillval);
+		ndirty += dirty;
+		dirty = dirty || (i < slot->count && slot->blk + i < until);
+		if ( dirty ) {
+			/* widen to the stripe, as far as one writev and
+			 * the previous run allow */
+			if ( i >= IOV_MAX && i - IOV_MAX + 1 > floor )
+				floor = i - IOV_MAX + 1;
+			start = stripe_start(opts, slot->blk + i,
+					slot->blk + floor) - slot->blk;
+		}
+
+		/* a run that has reached a clean block is held while the
+		 * next stripe could still carry it on, so runs that touch
+		 * go out as one writev, up to IOV_MAX blocks */
+		if ( !run_len )
+			ended = 0;
+		else if ( dirty )
+			ended = start > run + run_len || i - run >= IOV_MAX;
+		else
+			ended = i == slot->count || slot->blk + i >=
+				stripe_end(opts, slot->blk + run + run_len);
+
+		if ( ended ) {
+			worker_modified(eng->w, run_len);
+			if ( !opts->dryrun ) {
+				if ( opts->rate )
+					rate_write(opts->rate,
+						(unsigned long long)run_len *
+							fs->blocksize);
+				sqe = get_sqe(eng);
+				if ( sqe == NULL )
+					break;
+				op = get_op(slot,
+					(slot->blk + run) * fs->blocksize,
+					run_len * fs->blocksize);
+				if ( opts->throttle )
+					throttle_enter(opts->throttle,
+							&op->issued);
+				prep_op(eng, sqe, op);
+				slot->pending++;
+			}
+			floor = run + run_len;
+			run_len = 0;
+			if ( start < floor )
+				start = floor;
+		}
+		if ( dirty ) {
+			if ( !run_len )
+				run = start;
+			run_len = i + 1 - run;
+			until = stripe_end(opts, slot->blk + i);
+		}
+	}
+
+	worker_dirty(eng->w, ndirty);
+}
+
+/*
+ * Put slot back on the free list once nothing more is to be done with it.
+ */
+static void release(struct uring_engine *eng, struct uring_slot *slot)
+{
+	if ( slot->reading || slot->ready || slot->pending )
+		return;
+
+	slot->next = eng->free;
+	eng->free = slot;
+	eng->busy--;
+}
+
+static void complete(struct uring_engine *eng, struct io_uring_cqe *cqe)
+{
+	struct uring_op *op = io_uring_cqe_get_data(cqe);
+	struct uring_slot *slot = op->slot;
+	int res = cqe->res;
+
+	if ( eng->opts->throttle )
+		throttle_end(eng->opts->throttle, &op->issued);
+
+	/* a short transfer is resent for the rest; only one that did
+	 * nothing at all is an error */
+	if ( !slot->discard && res > 0 && res < (int)op->len ) {
+		op->off += res;
+		op->len -= res;
+		op->next = eng->retry;
+		eng->retry = op;
+		return;
+	}
+
+	if ( slot->reading ) {
+		slot->reading = 0;
+		if ( res != (int)op->len ) {
+			fprintf(stderr, "error while reading block\n");
+			eng->error = 1;
+		} else if ( !eng->error ) {
+			slot->ready = 1;
+			slot->next = eng->ready;
+			eng->ready = slot;
+		}
+	} else {
+		slot->pending--;
+		if ( res < 0 || (!slot->discard && res != (int)op->len) ) {
+			fprintf(stderr, slot->discard ?
+				"error while discarding block\n" :
+				"error while writing block\n");
+			eng->error = 1;
+		}
+	}
+
+	release(eng, slot);
+}
+
+/*
+ * Handle every completion there is, waiting for one first if asked to.
+ */
+static void collect(struct uring_engine *eng, int wait)
+{
+	struct io_uring_cqe *cqe = NULL;
+	int ret;
+
+	ret = wait ? io_uring_wait_cqe(&eng->ring, &cqe) :
+			io_uring_peek_cqe(&eng->ring, &cqe);
+	while ( ret == 0 ) {
+		complete(eng, cqe);
+		io_uring_cqe_seen(&eng->ring, cqe);
+		ret = io_uring_peek_cqe(&eng->ring, &cqe);
+	}
+	if ( ret < 0 && ret != -EAGAIN && ret != -EINTR ) {
+		fprintf(stderr, "io_uring wait failed: %s\n", strerror(-ret));
+		eng->error = 1;
+	}
+}
+
+/*
+ * Submit whatever is queued, handle completions, waiting for at least
+ * one when there is nothing else to do, and queue the writes of the
+ * chunks that were read.
+ */
+static void reap(struct uring_engine *eng)
+{
+	struct uring_slot *slot;
+	struct io_uring_sqe *sqe;
+	struct uring_op *op;
+
+	io_uring_submit(&eng->ring);
+	collect(eng, eng->ready == NULL && eng->retry == NULL);
+
+	/* the op still holds its slot, so the slot stays busy */
+	while ( (op = eng->retry) != NULL ) {
+		eng->retry = op->next;
+		sqe = eng->error ? NULL : get_sqe(eng);
+		if ( sqe == NULL ) {
+			if ( op->slot->reading )
+				op->slot->reading = 0;
+			else
+				op->slot->pending--;
+			release(eng, op->slot);
+			continue;
+		}
+		if ( eng->opts->throttle )
+			throttle_enter(eng->opts->throttle, &op->issued);
+		prep_op(eng, sqe, op);
+	}
+
+	while ( (slot = eng->ready) != NULL ) {
+		eng->ready = slot->next;
+		if ( !eng->error ) {
+			worker_scanned(eng->w, slot->count);
+			queue_writes(eng, slot);
+		}
+		slot->ready = 0;
+		release(eng, slot);
+	}
+
+	io_uring_submit(&eng->ring);
+}
+
+static struct uring_slot *get_slot(struct uring_engine *eng)
+{
+	struct uring_slot *slot;
+
+	while ( eng->free == NULL && !eng->error )
+		reap(eng);
+	if ( eng->error )
+		return NULL;
+
+	slot = eng->free;
+	eng->free = slot->next;
+	eng->busy++;
+
+	slot->reading = slot->ready = slot->discard = 0;
+	slot->pending = 0;
+	slot->nops = 0;
+	return slot;
+}
+
+/*
+ * Wait for the latency throttle to let op out.  Our own I/Os may be what
+ * it waits on, so completions are reaped meanwhile.
+ */
+static void throttle_wait(struct uring_engine *eng, struct uring_op *op)
+{
+	struct throttle *th = eng->opts->throttle;
+
+	while ( !throttle_try_begin(th, &op->issued) ) {
+		if ( eng->busy <= 1 ) {
+			throttle_begin(th, &op->issued);
+			return;
+		}
+		reap(eng);
+	}
+}
+
+/*
+ * Give up on op, which could not be submitted, and its slot.
+ */
+static void abandon(struct uring_engine *eng, struct uring_op *op)
+{
+	if ( eng->opts->throttle )
+		throttle_end(eng->opts->throttle, &op->issued);
+	op->slot->reading = op->slot->pending = 0;
+	release(eng, op->slot);
+}
+
+struct uring_engine *uring_engine_new(struct zero_worker *w)
+{
+	const struct zero_opts *opts = w->opts;
+	ext2_filsys fs = w->fs;
+	struct uring_engine *eng;
+	struct io_uring_params params;
+	struct iovec *iov;
+	size_t chunk;
+	unsigned int i;
+	int ret;
+
+	eng = calloc(1, sizeof(*eng));
+	if ( eng == NULL )
+		return NULL;
+
+	chunk = (size_t)opts->chunk_blocks * fs->blocksize;
+	eng->w = w;
+	eng->fs = fs;
+	eng->opts = opts;
+	eng->fd = w->fd;
+	eng->slots = calloc(opts->queue_depth, sizeof(*eng->slots));
+	eng->fill_iov = calloc(IOV_MAX, sizeof(*eng->fill_iov));
+	iov = calloc(opts->queue_depth, sizeof(*iov));
+
+	/* the read, then a write per dirty run: runs are split by a clean
+	 * block or on filling a writev */
+	eng->max_ops = 1 + opts->chunk_blocks / 2 + 1 +
+			opts->chunk_blocks / IOV_MAX;
+	eng->ops = calloc((size_t)opts->queue_depth * eng->max_ops,
+				sizeof(*eng->ops));
+	if ( eng->slots == NULL || eng->fill_iov == NULL || iov == NULL ||
+		eng->ops == NULL ||
+		posix_memalign((void **)&eng->bufs, 4096,
+				chunk * opts->queue_depth) )
+		goto fail;
+
+	/* every slot can have max_ops requests in flight, and the kernel
+	 * holds back further submissions while their completions overflow
+	 * the queue, so make room for them all where it allows */
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+	params.cq_entries = opts->queue_depth * eng->max_ops;
+	ret = io_uring_queue_init_params(opts->queue_depth * 2, &eng->ring,
+					&params);
+	if ( ret < 0 ) {
+		fprintf(stderr, "io_uring setup failed: %s\n", strerror(-ret));
+		goto fail;
+	}
+
+	for (i = 0; i < IOV_MAX; i++) {
+		eng->fill_iov[i].iov_base = opts->empty;
+		eng->fill_iov[i].iov_len = fs->blocksize;
+	}
+
+	for (i = 0; i < opts->queue_depth; i++) {
+		eng->slots[i].buf = eng->bufs + chunk * i;
+		eng->slots[i].index = i;
+		eng->slots[i].ops = eng->ops + (size_t)eng->max_ops * i;
+		eng->slots[i].next = eng->free;
+		eng->free = &eng->slots[i];
+		iov[i].iov_base = eng->slots[i].buf;
+		iov[i].iov_len = chunk;
+	}
+
+	/* both are optional, they only save per-I/O lookups in the kernel */
+	if ( io_uring_register_buffers(&eng->ring, iov, opts->queue_depth) == 0 )
+		eng->fixed_bufs = 1;
+	if ( io_uring_register_files(&eng->ring, &w->fd, 1) == 0 ) {
+		eng->fixed_file = 1;
+		eng->fd = 0;
+	}
+
+	free(iov);
+	return eng;
+
+fail:
+	free(iov);
+	free(eng->fill_iov);
+	free(eng->ops);
+	free(eng->slots);
+	free(eng->bufs);
+	free(eng);
+	return NULL;
+}
+
+/*
+ * Queue the free blocks first .. first+count-1.  Returns only once every
+ * chunk has been submitted, which may mean waiting for earlier ones.
+ */
+int uring_zero_extent(struct uring_engine *eng, blk64_t first, blk64_t count)
+{
+	const struct zero_opts *opts = eng->opts;
+	ext2_filsys fs = eng->fs;
+	struct io_uring_sqe *sqe;
+	struct uring_slot *slot;
+	struct uring_op *op;
+	blk64_t blk, end, n;
+
+	if ( eng->error )
+		return -1;
+
+	end = first + count;
+
+	if ( opts->discard ) {
+		/* io_uring can only punch holes in files */
+		if ( opts->dryrun || opts->dev.is_blkdev ) {
+			if ( discard_extent(eng->w, first, count) )
+				eng->error = 1;
+			return eng->error ? -1 : 0;
+		}
+
+		for (blk = first; blk < end; blk += n) {
+			n = end - blk;
+			if ( opts->discard_max && n > opts->discard_max )
+				n = opts->discard_max;
+
+			slot = get_slot(eng);
+			if ( slot == NULL )
+				return -1;
+			slot->discard = 1;
+			slot->pending = 1;
+			op = get_op(slot, blk * fs->blocksize,
+				n * fs->blocksize);
+
+			if ( opts->rate )
+				rate_op(opts->rate);
+			if ( opts->throttle )
+				throttle_wait(eng, op);
+			sqe = get_sqe(eng);
+			if ( sqe == NULL ) {
+				abandon(eng, op);
+				return -1;
+			}
+			io_uring_prep_fallocate(sqe, eng->fd,
+				FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				blk * fs->blocksize, n * fs->blocksize);
+			prep_common(eng, sqe, op);
+			worker_scanned(eng->w, n);
+			worker_modified(eng->w, n);
+		}
+		io_uring_submit(&eng->ring);
+		return 0;
+	}
+
+	for (blk = first; blk < end; blk += n) {
+		n = chunk_len(opts, blk, end);
+
+		slot = get_slot(eng);
+		if ( slot == NULL )
+			return -1;
+		slot->blk = blk;
+		slot->count = n;
+		slot->reading = 1;
+		op = get_op(slot, blk * fs->blocksize, n * fs->blocksize);
+
+		if ( opts->rate )
+			rate_read(opts->rate, n * fs->blocksize);
+		if ( opts->throttle )
+			throttle_wait(eng, op);
+		sqe = get_sqe(eng);
+		if ( sqe == NULL ) {
+			abandon(eng, op);
+			return -1;
+		}
+		prep_op(eng, sqe, op);
+	}
+	io_uring_submit(&eng->ring);
+
+	return 0;
+}
+
+/*
+ * Wait for everything still in flight.
+ */
+int uring_engine_drain(struct uring_engine *eng)
+{
+	while ( eng->busy )
+		reap(eng);
+
+	return eng->error ? -1 : 0;
+}
+
+/*
+ * Wait for everything still in flight and release the engine.
+ */
+int uring_engine_finish(struct uring_engine *eng)
+{
+	int error;
+
+	error = uring_engine_drain(eng);
+
+	io_uring_queue_exit(&eng->ring);
+	free(eng->fill_iov);
+	free(eng->ops);
+	free(eng->slots);
+	free(eng->bufs);
+	free(eng);
+
+	return error;
+}
@@ -0,0 +1,43 @@
+/*
+ * uring - io_uring engine for zerofree
+ *
+ * This file may be redistributed under the terms of the GNU General Public
+ * License, version 2.
+ */
+#ifndef ZEROFREE_URING_H
+#define ZEROFREE_URING_H
+
+#include "zerofree.h"
+
+struct uring_engine;
+
+#ifdef HAVE_LIBURING
+struct uring_engine *uring_engine_new(struct zero_worker *w);
+int uring_zero_extent(struct uring_engine *eng, blk64_t first,
+		blk64_t count);
+int uring_engine_drain(struct uring_engine *eng);
+int uring_engine_finish(struct uring_engine *eng);
+#else
+static inline struct uring_engine *uring_engine_new(struct zero_worker *w)
+{
+	return NULL;
+}
+
+static inline int uring_zero_extent(struct uring_engine *eng, blk64_t first,
+		blk64_t count)
+{
+	return -1;
+}
+
+static inline int uring_engine_drain(struct uring_engine *eng)
+{
+	return -1;
+}
+
+static inline int uring_engine_finish(struct uring_engine *eng)
+{
+	return -1;
+}
+#endif
+
+#endif
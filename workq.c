@@ -0,0 +1,129 @@
+/*
+ * workq - block ranges shared out between zerofree's worker threads
+ *
+ * The ranges are dealt out in contiguous slices, one per worker, so each
+ * worker walks its part of the disk in ascending order.  A worker whose
+ * slice runs dry steals from the far end of the fullest remaining slice,
+ * which keeps every thread busy however unevenly free space is spread.
+ *
+ * This file may be redistributed under the terms of the GNU General Public
+ * License, version 2.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "workq.h"
+
+int workq_init(struct work_queue *q)
+{
+	memset(q, 0, sizeof(*q));
+	return 0;
+}
+
+int workq_add(struct work_queue *q, blk64_t start, blk64_t end,
+		blk64_t cost)
+{
+	struct work_item *items;
+
+	if ( q->count == q->alloc ) {
+		q->alloc = q->alloc ? q->alloc * 2 : 256;
+		items = realloc(q->items, q->alloc * sizeof(*items));
+		if ( items == NULL )
+			return -1;
+		q->items = items;
+	}
+
+	q->items[q->count].start = start;
+	q->items[q->count].end = end;
+	q->items[q->count].cost = cost;
+	q->total_cost += cost;
+	q->count++;
+	return 0;
+}
+
+/*
+ * Deal the queued items out, in order, to nworkers slices of roughly
+ * equal total cost.
+ */
+int workq_start(struct work_queue *q, unsigned int nworkers)
+{
+	unsigned int i, j;
+	blk64_t cost, target;
+
+	q->deques = calloc(nworkers, sizeof(*q->deques));
+	if ( q->deques == NULL )
+		return -1;
+	q->nworkers = nworkers;
+
+	j = 0;
+	cost = 0;
+	for (i = 0; i < nworkers; i++) {
+		pthread_mutex_init(&q->deques[i].lock, NULL);
+		q->deques[i].head = j;
+
+		target = q->total_cost * (i+1) / nworkers;
+		while ( j < q->count && (cost < target || i == nworkers-1) )
+			cost += q->items[j++].cost;
+
+		q->deques[i].tail = j;
+	}
+
+	return 0;
+}
+
+/*
+ * Take the next item for a worker: the front of its own slice, or else
+ * the back of whichever slice has the most left.  Returns 0 once all
+ * the work has been handed out.
+ */
+int workq_next(struct work_queue *q, unsigned int worker,
+		struct work_item *item)
+{
+	struct work_deque *d = &q->deques[worker];
+	unsigned int i, left, most;
+	int victim;
+
+	pthread_mutex_lock(&d->lock);
+	if ( d->head < d->tail ) {
+		*item = q->items[d->head++];
+		pthread_mutex_unlock(&d->lock);
+		return 1;
+	}
+	pthread_mutex_unlock(&d->lock);
+
+	for (;;) {
+		victim = -1;
+		most = 0;
+		for (i = 0; i < q->nworkers; i++) {
+			pthread_mutex_lock(&q->deques[i].lock);
+			left = q->deques[i].tail - q->deques[i].head;
+			pthread_mutex_unlock(&q->deques[i].lock);
+			if ( left > most ) {
+				most = left;
+				victim = i;
+			}
+		}
+		if ( victim < 0 )
+			return 0;
+
+		d = &q->deques[victim];
+		pthread_mutex_lock(&d->lock);
+		if ( d->head < d->tail ) {
+			*item = q->items[--d->tail];
+			pthread_mutex_unlock(&d->lock);
+			return 1;
+		}
+		pthread_mutex_unlock(&d->lock);
+	}
+}
+
+void workq_free(struct work_queue *q)
+{
+	unsigned int i;
+
+	for (i = 0; i < q->nworkers; i++)
+		pthread_mutex_destroy(&q->deques[i].lock);
+	free(q->deques);
+	free(q->items);
+	memset(q, 0, sizeof(*q));
+}
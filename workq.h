@@ -0,0 +1,43 @@
+/*
+ * workq - block ranges shared out between zerofree's worker threads
+ *
+ * This file may be redistributed under the terms of the GNU General Public
+ * License, version 2.
+ */
+#ifndef ZEROFREE_WORKQ_H
+#define ZEROFREE_WORKQ_H
+
+#include <ext2fs/ext2fs.h>
+#include <pthread.h>
+
+struct work_item {
+	blk64_t		start;		/* first block */
+	blk64_t		end;		/* one past the last block */
+	blk64_t		cost;		/* expected work, e.g. free blocks */
+};
+
+/* a contiguous slice of the item array owned by one worker */
+struct work_deque {
+	pthread_mutex_t	lock;
+	unsigned int	head;		/* next item the owner takes */
+	unsigned int	tail;		/* one past the last item */
+};
+
+struct work_queue {
+	struct work_item	*items;
+	unsigned int		count;
+	unsigned int		alloc;
+	blk64_t			total_cost;
+	struct work_deque	*deques;
+	unsigned int		nworkers;
+};
+
+int workq_init(struct work_queue *q);
+int workq_add(struct work_queue *q, blk64_t start, blk64_t end,
+		blk64_t cost);
+int workq_start(struct work_queue *q, unsigned int nworkers);
+int workq_next(struct work_queue *q, unsigned int worker,
+		struct work_item *item);
+void workq_free(struct work_queue *q);
+
+#endif
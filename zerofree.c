@@ -15,42 +15,130 @@
  *             Jan Krämer.
  */
 
-#include <ext2fs/ext2fs.h>
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
+#include <getopt.h>
+#include <signal.h>
 #include <pthread.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/falloc.h>
 
-#define USAGE "usage: %s [-t count] [-n] [-v] [-d] [-f fillval] filesystem\n"
+#include "zerofree.h"
+#include "uring.h"
+#include "workq.h"
+#include "fillcheck.h"
+#include "pipeline.h"
+#include "checkpoint.h"
+#include "cleancache.h"
+#include "report.h"
+#include "progress.h"
+#include "ratelimit.h"
+#include "throttle.h"
+#include "autotune.h"
 
-pthread_barrier_t g_thread_barrier;
-pthread_mutex_t fs_mux;
-#define LOCK(x) pthread_mutex_lock(&x)
-#define UNLOCK(x) pthread_mutex_unlock(&x)
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
 
-void zero_func(ext2_filsys fs, unsigned long blk, unsigned char* buf,
-		unsigned char* empty, unsigned int fillval, int dryrun,
-		int discard, int* error);
+#define USAGE "usage: %s [-t count|auto] [-c chunksize] [-q depth] [-p checkers]" \
+		" [-n] [-v] [-a] [-d] [-e] [-b] [-s] [-z] [-f fillval]\n" \
+		"\t[--ordered]\n" \
+		"\t[--checkpoint file [--checkpoint-interval secs] [--resume]]" \
+		" [--clean-cache file]\n" \
+		"\t[--report file [--report-format json|csv]]" \
+		" [--progress-fd fd [--progress-interval secs]]\n" \
+		"\t[--max-read-mbps n] [--max-write-mbps n] [--max-iops n]" \
+		" [--latency-target ms] filesystem\n" \
+		"--clean-cache only saves work if the filesystem has not been" \
+		" mounted since the last run\n"
+
+/* default amount of data read from a free extent per request */
+#define DEFAULT_CHUNK_SIZE	(1024*1024)
+
+/* io_uring takes 32-bit read lengths, so keep well clear of 4 GiB */
+#define MAX_CHUNK_SIZE		(1024*1024*1024UL)
+
+/* chunks are only rounded up to whole RAID stripes as far as this, or
+ * the -c size if that is larger, so each buffer stays a sensible size */
+#define MAX_STRIPE_CHUNK	(16*1024*1024)
+
+/* default time between checkpoint saves, in seconds */
+#define DEFAULT_CHECKPOINT_INTERVAL	60
+
+enum {
+	OPT_CHECKPOINT = 256,
+	OPT_CHECKPOINT_INTERVAL,
+	OPT_RESUME,
+	OPT_CLEAN_CACHE,
+	OPT_REPORT,
+	OPT_REPORT_FORMAT,
+	OPT_PROGRESS_FD,
+	OPT_PROGRESS_INTERVAL,
+	OPT_MAX_READ_MBPS,
+	OPT_MAX_WRITE_MBPS,
+	OPT_MAX_IOPS,
+	OPT_LATENCY_TARGET,
+	OPT_ORDERED,
+};
+
+static const struct option long_options[] = {
+	{ "checkpoint",		 required_argument, NULL, OPT_CHECKPOINT },
+	{ "checkpoint-interval", required_argument, NULL,
+						OPT_CHECKPOINT_INTERVAL },
+	{ "resume",		 no_argument,	    NULL, OPT_RESUME },
+	{ "clean-cache",	 required_argument, NULL, OPT_CLEAN_CACHE },
+	{ "report",		 required_argument, NULL, OPT_REPORT },
+	{ "report-format",	 required_argument, NULL, OPT_REPORT_FORMAT },
+	{ "progress-fd",	 required_argument, NULL, OPT_PROGRESS_FD },
+	{ "progress-interval",	 required_argument, NULL,
+						OPT_PROGRESS_INTERVAL },
+	{ "max-read-mbps",	 required_argument, NULL, OPT_MAX_READ_MBPS },
+	{ "max-write-mbps",	 required_argument, NULL, OPT_MAX_WRITE_MBPS },
+	{ "max-iops",		 required_argument, NULL, OPT_MAX_IOPS },
+	{ "latency-target",	 required_argument, NULL, OPT_LATENCY_TARGET },
+	{ "ordered",		 no_argument,	    NULL, OPT_ORDERED },
+	{ NULL,			 0,		    NULL, 0 }
+};
+
+/* set by SIGINT or SIGTERM while a checkpoint is kept */
+static volatile sig_atomic_t stop_requested;
 
 struct thread_arg {
-	ext2_filsys	fs;
-	unsigned long	start_blk;
-	unsigned long 	end_blk;
-	unsigned int	fillval;
-	int		dryrun;
-	int		discard;
-	unsigned char	*empty;		/* shared by all threads */
+	ext2_filsys		fs;
+	const struct zero_opts	*opts;
+	struct work_queue	*queue;
+	unsigned int		index;		/* this thread's deque */
+	blk64_t			modified;	/* set when the thread ends */
 };
 
-void single_thread(ext2_filsys fs, unsigned int fillval, int dryrun,
-		int verbose, int discard, unsigned char *empty,
-		unsigned char *buf);
+int parse_size(const char *str, unsigned long *size);
+int parse_rate(const char *str, double *rate);
+const char *choose_method(struct zero_opts *opts);
+const char *method_name(const struct zero_opts *opts);
+void discard_limits(struct zero_opts *opts, unsigned int blocksize);
+
+int plan_groups(ext2_filsys fs, struct work_queue *q,
+		const struct zero_opts *opts);
+int zero_range(struct zero_worker *w, blk64_t start, blk64_t end);
+int run_item(struct zero_worker *w, const struct work_item *item);
+int item_done(struct zero_worker *w, const struct work_item *item);
+void request_stop(int sig);
+
+void single_thread(ext2_filsys fs, const struct zero_opts *opts,
+		struct work_queue *plan, blk64_t *modified);
 
 void* zero_thread(void* arg);
-void multi_thread(ext2_filsys fs, long thread_count, unsigned int fillval,
-		int dryrun, int discard, unsigned char *empty,
-		unsigned char *buf);
+int multi_thread(ext2_filsys fs, long thread_count,
+		const struct zero_opts *opts, struct work_queue *plan,
+		blk64_t *modified);
 
 void bailout(void* mem0, void* mem1) __attribute__ ((noreturn));
 
@@ -62,41 +150,131 @@ int main(int argc, char **argv)
 	int open_flags = EXT2_FLAG_RW;
 	int blocksize = 0;
 	ext2_filsys fs = NULL;
-	unsigned long blk;
-	unsigned char *buf;
 	unsigned char *empty;
-	int i, c;
+	int c;
 	unsigned int fillval = 0;
 	int verbose = 0;
 	int dryrun = 0;
 	int discard = 0;
+	int blind = 0;
+	int punch = 0;
+	int zeroout = 0;
+	int autosel = 0;
+	int edges = 0;
 	long thread_count = 1;
+	unsigned long chunk_size = DEFAULT_CHUNK_SIZE;
+	blk64_t max_chunk;
+	long queue_depth = 0;
+	long checkers = 0;
+	int ordered = 0;
+	struct zero_opts opts;
+	struct work_queue plan;
+	blk64_t modified = 0;
+	const char *ckpt_path = NULL;
+	long ckpt_interval = DEFAULT_CHECKPOINT_INTERVAL;
+	int resume = 0;
+	struct checkpoint ckpt;
+	const char *clean_path = NULL;
+	struct clean_cache clean;
+	const char *report_path = NULL;
+	int report_csv = 0;
+	struct report report;
+	int progress_fd = -1;
+	double progress_interval = 1.0;
+	struct progress progress;
+	double max_read = 0, max_write = 0, max_iops = 0;
+	struct rate_limit rate;
+	double latency_target = 0;
+	struct throttle throttle;
+	struct sigaction sa;
 
-	while ( (c=getopt(argc, argv, "t:nvdf:")) != -1 ) {
+	while ( (c=getopt_long(argc, argv, "t:c:q:p:nvadebszf:", long_options,
+					NULL)) != -1 ) {
 		switch (c) {
 		case 't':
 			{
 				char *endptr;
+				/* 0 asks for the count to be chosen for us */
+				if ( !strcmp(optarg, "auto") ) {
+					thread_count = 0;
+					break;
+				}
 				thread_count = strtol(optarg, &endptr, 0);
 				if (!*optarg || *endptr || thread_count < 0) {
 					fprintf(stderr, "%s: invalid argument"
 						" to -t\n", argv[0]);
 					return 1;
 				}
-				fprintf(stderr, "USE %d threads\n", thread_count);
+				if ( !thread_count )
+					break;
+				fprintf(stderr, "USE %ld threads\n", thread_count);
 				fprintf(stderr, "WARNING: Running multiple threads"
 					" might damage your spinning device!\n");
 			}
 			break;
+		case 'c':
+			if ( parse_size(optarg, &chunk_size) || !chunk_size ||
+				chunk_size > MAX_CHUNK_SIZE ) {
+				fprintf(stderr, "%s: invalid argument to -c\n",
+					argv[0]);
+				return 1;
+			}
+			break;
+		case 'q':
+			{
+				char *endptr;
+				queue_depth = strtol(optarg, &endptr, 0);
+				if ( !*optarg || *endptr || queue_depth < 0 ||
+					queue_depth > 4096 ) {
+					fprintf(stderr, "%s: invalid argument"
+						" to -q\n", argv[0]);
+					return 1;
+				}
+#ifndef HAVE_LIBURING
+				if ( queue_depth ) {
+					fprintf(stderr, "%s: built without"
+						" io_uring support\n", argv[0]);
+					return 1;
+				}
+#endif
+			}
+			break;
+		case 'p':
+			{
+				char *endptr;
+				checkers = strtol(optarg, &endptr, 0);
+				if ( !*optarg || *endptr || checkers < 0 ||
+					checkers > 256 ) {
+					fprintf(stderr, "%s: invalid argument"
+						" to -p\n", argv[0]);
+					return 1;
+				}
+			}
+			break;
 		case 'n' :
 			dryrun = 1;
 			break;
 		case 'v' :
 			verbose = 1;
 			break;
+		case 'a':
+			autosel = 1;
+			break;
 		case 'd':
 			discard = 1;
 			break;
+		case 'e':
+			edges = 1;
+			break;
+		case 'b':
+			blind = 1;
+			break;
+		case 's':
+			punch = 1;
+			break;
+		case 'z':
+			zeroout = 1;
+			break;
 		case 'f' :
 			{
 				char *endptr;
@@ -111,6 +289,89 @@ int main(int argc, char **argv)
 				printf("fillval = %d\n", fillval);
 			}
 			break;
+		case OPT_CHECKPOINT:
+			ckpt_path = optarg;
+			break;
+		case OPT_CHECKPOINT_INTERVAL:
+			{
+				char *endptr;
+				ckpt_interval = strtol(optarg, &endptr, 0);
+				if ( !*optarg || *endptr || ckpt_interval < 0 ) {
+					fprintf(stderr, "%s: invalid argument"
+						" to --checkpoint-interval\n",
+						argv[0]);
+					return 1;
+				}
+			}
+			break;
+		case OPT_RESUME:
+			resume = 1;
+			break;
+		case OPT_CLEAN_CACHE:
+			clean_path = optarg;
+			break;
+		case OPT_REPORT:
+			report_path = optarg;
+			break;
+		case OPT_PROGRESS_FD:
+			{
+				char *endptr;
+				progress_fd = strtol(optarg, &endptr, 0);
+				if ( !*optarg || *endptr || progress_fd < 0 ||
+					fcntl(progress_fd, F_GETFD) == -1 ) {
+					fprintf(stderr, "%s: invalid argument"
+						" to --progress-fd\n", argv[0]);
+					return 1;
+				}
+			}
+			break;
+		case OPT_PROGRESS_INTERVAL:
+			{
+				char *endptr;
+				progress_interval = strtod(optarg, &endptr);
+				if ( !*optarg || *endptr ||
+					!(progress_interval > 0) ) {
+					fprintf(stderr, "%s: invalid argument"
+						" to --progress-interval\n",
+						argv[0]);
+					return 1;
+				}
+			}
+			break;
+		case OPT_MAX_READ_MBPS:
+		case OPT_MAX_WRITE_MBPS:
+		case OPT_MAX_IOPS:
+			if ( parse_rate(optarg, c == OPT_MAX_READ_MBPS ?
+					&max_read : c == OPT_MAX_WRITE_MBPS ?
+					&max_write : &max_iops) ) {
+				fprintf(stderr, "%s: invalid argument to --%s\n",
+					argv[0], c == OPT_MAX_READ_MBPS ?
+					"max-read-mbps" : c == OPT_MAX_WRITE_MBPS ?
+					"max-write-mbps" : "max-iops");
+				return 1;
+			}
+			break;
+		case OPT_ORDERED:
+			ordered = 1;
+			break;
+		case OPT_LATENCY_TARGET:
+			if ( parse_rate(optarg, &latency_target) ) {
+				fprintf(stderr, "%s: invalid argument to"
+					" --latency-target\n", argv[0]);
+				return 1;
+			}
+			break;
+		case OPT_REPORT_FORMAT:
+			if ( !strcmp(optarg, "csv") ) {
+				report_csv = 1;
+			} else if ( !strcmp(optarg, "json") ) {
+				report_csv = 0;
+			} else {
+				fprintf(stderr, "%s: --report-format must be"
+					" json or csv\n", argv[0]);
+				return 1;
+			}
+			break;
 		default :
 			fprintf(stderr, USAGE, argv[0]);
 			return 1;
@@ -122,6 +383,57 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
+	if ( queue_depth && (checkers || ordered) ) {
+		fprintf(stderr, "%s: -q cannot be used with -p or --ordered\n",
+			argv[0]);
+		return 1;
+	}
+
+	/* a single stream of I/O is the point of --ordered */
+	if ( ordered && thread_count > 1 ) {
+		fprintf(stderr, "%s: --ordered cannot be used with more than"
+			" one thread\n", argv[0]);
+		return 1;
+	}
+
+	if ( autosel + discard + blind + punch + zeroout > 1 ) {
+		fprintf(stderr, "%s: only one of -a, -d, -b, -s and -z can be"
+			" used\n", argv[0]);
+		return 1;
+	}
+
+	if ( resume && !ckpt_path ) {
+		fprintf(stderr, "%s: --resume needs --checkpoint\n", argv[0]);
+		return 1;
+	}
+
+	if ( edges && !discard && !autosel ) {
+		fprintf(stderr, "%s: -e only applies to -d\n", argv[0]);
+		return 1;
+	}
+
+	/* these modes read nothing, so they have no use for -q or -p */
+	if ( (blind || punch || zeroout) &&
+		(queue_depth || checkers || ordered) ) {
+		fprintf(stderr, "%s: -b, -s and -z cannot be used with -q,"
+			" -p or --ordered\n", argv[0]);
+		return 1;
+	}
+
+	/* a discard reads nothing either, though io_uring can issue it */
+	if ( discard && (checkers || ordered) ) {
+		fprintf(stderr, "%s: -d cannot be used with -p or --ordered\n",
+			argv[0]);
+		return 1;
+	}
+
+	/* holes and zeroed ranges always read back as zeros */
+	if ( (punch || zeroout) && fillval ) {
+		fprintf(stderr, "%s: -s and -z only work with a fill value"
+			" of 0\n", argv[0]);
+		return 1;
+	}
+
 	ret = ext2fs_check_if_mounted(argv[optind], &flags);
 	if ( ret ) {
 		fprintf(stderr, "%s: failed to determine filesystem mount state  %s\n",
@@ -135,6 +447,12 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
+	/* legacy 32-bit bitmaps fail on filesystems of more than 2^32 blocks,
+	 * and lack the fast searches next_free_extent() relies on */
+#if defined(EXT2_FLAG_64BITS)
+	open_flags |= EXT2_FLAG_64BITS;
+#endif
+
 	ret = ext2fs_open(argv[optind], open_flags, superblock, blocksize,
 							unix_io_manager, &fs);
 	if ( ret ) {
@@ -143,38 +461,251 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
+	opts.fillval = fillval;
+	opts.dryrun = dryrun;
+	opts.verbose = verbose;
+	opts.discard = discard;
+	opts.blind = blind;
+	opts.punch = punch;
+	opts.zeroout = zeroout;
+	opts.zeroout_max = 0;
+	opts.discard_max = 0;
+	opts.discard_gran = 0;
+	opts.discard_align = 0;
+	opts.discard_edges = edges;
+	opts.ckpt = NULL;
+	opts.clean = NULL;
+	opts.report = NULL;
+	opts.progress = NULL;
+	opts.rate = NULL;
+	opts.throttle = NULL;
+	opts.queue_depth = queue_depth;
+	opts.checkers = checkers;
+	opts.ordered = ordered;
+	if ( ordered && !checkers ) {
+		opts.checkers = online_cpus();
+	}
+	opts.chunk_blocks = chunk_size / fs->blocksize;
+	if ( opts.chunk_blocks == 0 )
+		opts.chunk_blocks = 1;
+	opts.stripe = 0;
+
 	empty = (unsigned char *)malloc(fs->blocksize);
-	buf = (unsigned char *)malloc(fs->blocksize);
 
-	if ( empty == NULL || buf == NULL ) {
+	if ( empty == NULL ) {
 		fprintf(stderr, "%s: out of memory (surely not?)\n", argv[0]);
-		bailout((void*) empty, (void*) buf);
+		bailout(NULL, NULL);
 	}
 
 	memset(empty, fillval, fs->blocksize);
+	opts.empty = empty;
+	fill_check_init();
+	opts.device = argv[optind];
+
+	dev_info_probe(argv[optind], &opts.dev);
+
+	/* the RAID stripe mke2fs was given; an image file has no use for it.
+	 * The stride is only one disk's chunk of a stripe, so writing whole
+	 * strides would still leave the array to read, modify and write */
+	if ( opts.dev.is_blkdev ) {
+		opts.stripe = fs->super->s_raid_stripe_width;
+	}
+
+	/* every read buffer has to hold a whole stripe */
+	max_chunk = (chunk_size > MAX_STRIPE_CHUNK ? chunk_size :
+				MAX_STRIPE_CHUNK) / fs->blocksize;
+	if ( opts.stripe > max_chunk ) {
+		if ( verbose ) {
+			printf("stripe of %llu blocks is too wide,"
+				" ignoring it\n",
+				(unsigned long long)opts.stripe);
+		}
+		opts.stripe = 0;
+	}
+	if ( opts.stripe ) {
+		opts.chunk_blocks += opts.stripe - 1;
+		opts.chunk_blocks -= opts.chunk_blocks % opts.stripe;
+		if ( opts.chunk_blocks > max_chunk )
+			opts.chunk_blocks -= opts.stripe;
+		if ( verbose ) {
+			printf("stripe = %llu blocks\n",
+				(unsigned long long)opts.stripe);
+		}
+	}
+	if ( autosel ) {
+		printf("method = %s\n", choose_method(&opts));
+		if ( edges && !opts.discard ) {
+			fprintf(stderr, "%s: -a did not choose discard,"
+				" ignoring -e\n", argv[0]);
+			opts.discard_edges = 0;
+		}
+	}
+
+	if ( opts.punch && !opts.dev.is_file ) {
+		fprintf(stderr, "%s: -s needs a regular image file\n", argv[0]);
+		bailout((void*) empty, NULL);
+	}
+	if ( opts.zeroout && opts.dev.is_blkdev ) {
+		opts.zeroout_max = opts.dev.write_zeroes_max_bytes /
+							fs->blocksize;
+		if ( !opts.zeroout_max ) {
+			fprintf(stderr, "%s: %s has no write zeroes support,"
+				" writing zeros instead\n", argv[0],
+				argv[optind]);
+			opts.zeroout = 0;
+			opts.blind = 1;
+		}
+	}
+	if ( opts.discard )
+		discard_limits(&opts, fs->blocksize);
 
 	ret = ext2fs_read_block_bitmap(fs);
 	if ( ret ) {
 		fprintf(stderr, "%s: error while reading block bitmap\n", argv[0]);
-		bailout((void*) empty, (void*) buf);
+		bailout((void*) empty, NULL);
+	}
+
+	if ( ckpt_path ) {
+		if ( ckpt_init(&ckpt, fs, ckpt_path, ckpt_interval,
+				method_name(&opts), fillval, dryrun) ) {
+			fprintf(stderr, "%s: out of memory (surely not?)\n",
+				argv[0]);
+			bailout((void*) empty, NULL);
+		}
+		if ( resume && ckpt_load(&ckpt) ) {
+			bailout((void*) empty, NULL);
+		}
+		opts.ckpt = &ckpt;
+
+		/* stop between groups so the checkpoint stays exact */
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = request_stop;
+		sigaction(SIGINT, &sa, NULL);
+		sigaction(SIGTERM, &sa, NULL);
+	}
+
+	if ( clean_path ) {
+		if ( clean_init(&clean, fs, clean_path, fillval) ) {
+			fprintf(stderr, "%s: out of memory (surely not?)\n",
+				argv[0]);
+			bailout((void*) empty, NULL);
+		}
+		clean_load(&clean);
+		opts.clean = &clean;
+	}
+
+	if ( report_path ) {
+		if ( report_init(&report, fs) ) {
+			fprintf(stderr, "%s: out of memory (surely not?)\n",
+				argv[0]);
+			bailout((void*) empty, NULL);
+		}
+		opts.report = &report;
+	}
+
+	if ( plan_groups(fs, &plan, &opts) ) {
+		fprintf(stderr, "%s: out of memory (surely not?)\n", argv[0]);
+		bailout((void*) empty, NULL);
+	}
+
+	/* one set of buckets, so the limits hold for the whole run, the
+	 * calibration of -t 0 included */
+	if ( max_read || max_write || max_iops || latency_target ) {
+		rate_init(&rate, max_read * 1024 * 1024, max_write * 1024 * 1024,
+				max_iops);
+		opts.rate = &rate;
+	}
+
+	/* start with as much in flight as the workers can have at once */
+	if ( latency_target ) {
+		throttle_init(&throttle, latency_target / 1000,
+			thread_count ? thread_count * worker_depth(&opts) :
+			AUTO_MAX_READERS, opts.rate);
+		opts.throttle = &throttle;
+	}
+
+	if ( thread_count == 0 ) {
+		if ( auto_tune(fs, &opts, &plan, &thread_count) ) {
+			bailout((void*) empty, NULL);
+		}
+		if ( opts.throttle ) {
+			throttle_resize(opts.throttle,
+					thread_count * worker_depth(&opts));
+		}
+	}
+
+	/* the group descriptors are kept current, unlike the superblock */
+	if ( progress_fd >= 0 ) {
+		if ( progress_start(&progress, progress_fd, progress_interval,
+				plan.total_cost, fs->blocksize,
+				thread_count > 1 ? thread_count : 1) ) {
+			fprintf(stderr, "%s: failed to start progress\n",
+				argv[0]);
+			bailout((void*) empty, NULL);
+		}
+		opts.progress = &progress;
 	}
 
-	if (thread_count == 1) {
-		single_thread(fs, fillval, dryrun, verbose, discard, empty, buf);
+	if (thread_count <= 1) {
+		single_thread(fs, &opts, &plan, &modified);
 	}
-	else {
-		multi_thread(fs, thread_count, fillval, dryrun, discard, empty, buf);
+	else if (multi_thread(fs, thread_count, &opts, &plan, &modified)) {
+		bailout((void*) empty, NULL);
+	}
+	workq_free(&plan);
+
+	if ( opts.progress ) {
+		progress_stop(opts.progress);
+	}
+
+	if ( opts.throttle ) {
+		throttle_free(opts.throttle);
+	}
+	if ( opts.rate ) {
+		rate_free(opts.rate);
+	}
+
+	if ( opts.ckpt ) {
+		if ( stop_requested ) {
+			ckpt_save(opts.ckpt, -1);
+			fprintf(stderr, "%s: interrupted, progress saved in %s\n",
+				argv[0], ckpt_path);
+		} else {
+			/* nothing is left to resume */
+			unlink(ckpt_path);
+		}
+		ckpt_free(opts.ckpt);
+	}
+
+	if ( opts.report ) {
+		report_write(opts.report, fs, &opts, report_path, report_csv);
+		report_free(opts.report);
+	}
+
+	/* a discard leaves whatever the device likes behind */
+	if ( opts.clean ) {
+		if ( !dryrun && !opts.discard ) {
+			clean_save(opts.clean);
+		}
+		clean_free(opts.clean);
+	}
+
+	if ( blind || punch || zeroout || autosel || verbose ) {
+		printf("%llu bytes %s%s\n",
+			(unsigned long long)modified * fs->blocksize,
+			dryrun ? "would be " : "",
+			opts.discard ? "discarded" : opts.punch ? "punched" :
+			opts.zeroout ? "zeroed" : "written");
 	}
 
 	ret = ext2fs_close(fs);
 	if ( ret ) {
 		fprintf(stderr, "%s: error while closing filesystem\n", argv[0]);
-		bailout((void*) empty, (void*) buf);
+		bailout((void*) empty, NULL);
 	}
 
-	free(buf);
 	free(empty);
-	return 0;
+	return stop_requested ? 1 : 0;
 }
 
 void bailout(void* mem0, void* mem1)
@@ -190,193 +721,907 @@ void bailout(void* mem0, void* mem1)
 	exit(1);
 }
 
-void multi_thread(ext2_filsys fs, long thread_count, unsigned int fillval,
-		int dryrun, int discard, unsigned char *empty,
-		unsigned char *buf)
+/*
+ * Parse a byte count with an optional K, M or G suffix.  strtoul() would
+ * take a minus sign and wrap the value round, so that is refused, as is
+ * anything that does not fit.
+ */
+int parse_size(const char *str, unsigned long *size)
 {
-	int 			i, ret;
+	char *endptr;
+	unsigned long val;
+	unsigned int shift = 0;
+
+	if ( strchr(str, '-') )
+		return -1;
+
+	errno = 0;
+	val = strtoul(str, &endptr, 0);
+	if ( !*str || endptr == str || errno )
+		return -1;
+
+	switch (*endptr) {
+	case 'G': case 'g':
+		shift += 10;
+		/* fall through */
+	case 'M': case 'm':
+		shift += 10;
+		/* fall through */
+	case 'K': case 'k':
+		shift += 10;
+		endptr++;
+		break;
+	}
+
+	if ( *endptr || val > ULONG_MAX >> shift )
+		return -1;
+	val <<= shift;
+
+	*size = val;
+	return 0;
+}
+
+/*
+ * Parse a positive rate limit, which may have a fractional part.
+ */
+int parse_rate(const char *str, double *rate)
+{
+	char *endptr;
+
+	*rate = strtod(str, &endptr);
+	if ( !*str || *endptr || !(*rate > 0) )
+		return -1;
+
+	return 0;
+}
+
+/*
+ * The number of checker threads worth running, within the limit of -p.
+ */
+unsigned int online_cpus(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return n < 1 ? 1 : n > 256 ? 256 : n;
+}
+
+/*
+ * Pick the cheapest way to leave zeros in the free blocks of the target
+ * probed into opts->dev.  An image file gets holes punched; a device
+ * that can write zeroes itself is asked to; a discard is only used where
+ * the device promises that discarded blocks read back as zeros.  Anything
+ * else, and any other fill value, is read, checked and written.
+ */
+const char *choose_method(struct zero_opts *opts)
+{
+	const struct dev_info *dev = &opts->dev;
+
+	if ( opts->fillval )
+		return method_name(opts);
+
+	if ( dev->is_file && dev->can_punch ) {
+		opts->punch = 1;
+	} else if ( dev->is_blkdev && dev->write_zeroes_max_bytes ) {
+		opts->zeroout = 1;
+	} else if ( dev->is_blkdev && dev->discard_zeroes_data &&
+			dev->discard_max_bytes ) {
+		opts->discard = 1;
+	}
+
+	/* only the write method reads anything */
+	if ( opts->punch || opts->zeroout || opts->discard ) {
+		opts->queue_depth = 0;
+		opts->checkers = 0;
+		opts->ordered = 0;
+	}
+
+	if ( opts->verbose && dev->is_blkdev )
+		fprintf(stderr, "%s: write_zeroes_max_bytes %llu,"
+			" discard_zeroes_data %llu\n",
+			opts->device, dev->write_zeroes_max_bytes,
+			dev->discard_zeroes_data);
+
+	return method_name(opts);
+}
+
+/*
+ * The name of the method opts select, as -a prints it.
+ */
+const char *method_name(const struct zero_opts *opts)
+{
+	return opts->discard ? "discard" : opts->punch ? "punch" :
+		opts->zeroout ? "zero-range" : opts->blind ? "blind" :
+		"write";
+}
+
+/*
+ * Turn the device's discard limits into blocks.  Devices ignore discards
+ * that do not cover whole granules, which start discard_alignment bytes
+ * into the partition.  A granule boundary inside a filesystem block
+ * cannot be met, so in that case extents are discarded unaligned.
+ */
+void discard_limits(struct zero_opts *opts, unsigned int blocksize)
+{
+	const struct dev_info *dev = &opts->dev;
+
+	opts->discard_max = dev->discard_max_bytes / blocksize;
+
+	if ( dev->discard_granularity <= blocksize ||
+		dev->discard_granularity % blocksize ||
+		dev->discard_alignment % blocksize ) {
+		if ( opts->verbose && dev->discard_granularity > blocksize )
+			fprintf(stderr, "%s: discard granules are not block"
+				" aligned, discarding unaligned\n",
+				opts->device);
+	} else {
+		opts->discard_gran = dev->discard_granularity / blocksize;
+		opts->discard_align = dev->discard_alignment / blocksize %
+							opts->discard_gran;
+	}
+
+	/* md RAID 5 and 6 drop whatever part of a discard is not whole
+	 * stripes, so treat the stripe as the granule where it is one */
+	if ( opts->stripe && !opts->discard_align &&
+		(!opts->discard_gran ||
+		 opts->stripe % opts->discard_gran == 0) )
+		opts->discard_gran = opts->stripe;
+
+	if ( opts->discard_gran && opts->discard_max >= opts->discard_gran )
+		opts->discard_max -= opts->discard_max % opts->discard_gran;
+}
+
+/*
+ * Build the list of block groups worth visiting, in disk order.  The
+ * group descriptors already say how many blocks of each group are free,
+ * so full groups are dropped without reading a single bitmap bit, and
+ * the rest are weighted by their free count to balance the workers.
+ * Groups that a resumed checkpoint records as finished are dropped too,
+ * as are those the clean cache says have not changed since they were
+ * last cleaned.
+ */
+int plan_groups(ext2_filsys fs, struct work_queue *q,
+		const struct zero_opts *opts)
+{
+	struct checkpoint *ck = opts->ckpt;
+	struct clean_cache *cc = opts->clean;
+	dgrp_t group;
+	blk64_t free_blocks;
+
+	workq_init(q);
+	for (group = 0; group < fs->group_desc_count; group++) {
+		free_blocks = ext2fs_bg_free_blocks_count(fs, group);
+		if ( !free_blocks || (ck && ckpt_finished(ck, group)) ) {
+			if ( cc )
+				clean_mark(cc, group);
+			continue;
+		}
+		if ( cc && clean_known(cc, group) )
+			continue;
+
+		if ( workq_add(q, ext2fs_group_first_block2(fs, group),
+				ext2fs_group_last_block2(fs, group) + 1,
+				free_blocks) )
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Let thread_count workers take groups from the plan until it is empty.
+ * Returns -1 if any worker failed.
+ */
+int multi_thread(ext2_filsys fs, long thread_count,
+		const struct zero_opts *opts, struct work_queue *plan,
+		blk64_t *modified)
+{
+	int 			i, error = 0;
 	pthread_t		*tid_array;
 	struct thread_arg	*arg_array;
-	unsigned long		blk, part_size, pivot;
-	int			error = 0;
+	void			*ret;
 
 	tid_array = malloc(sizeof(pthread_t)*thread_count);
 	arg_array = malloc(sizeof(struct thread_arg)*thread_count);
 
-	pthread_barrier_init(&g_thread_barrier, NULL, thread_count+1);
-	pthread_mutex_init(&fs_mux, NULL);
-
-	pivot = fs->super->s_first_data_block;
-	part_size = (fs->super->s_blocks_count - fs->super->s_first_data_block)
-			/thread_count;
+	if ( tid_array == NULL || arg_array == NULL ||
+		workq_start(plan, thread_count) ) {
+		fprintf(stderr, "out of memory (surely not?)\n");
+		error = 1;
+		goto out;
+	}
 
 	for (i=0; i < thread_count; i++) {
 		arg_array[i].fs = fs;
-		arg_array[i].start_blk = pivot;
-		arg_array[i].end_blk = part_size*(i+1);
-		arg_array[i].fillval = fillval;
-		arg_array[i].dryrun = dryrun;
-		arg_array[i].discard = discard;
-		arg_array[i].empty = empty;
+		arg_array[i].opts = opts;
+		arg_array[i].queue = plan;
+		arg_array[i].index = i;
+		arg_array[i].modified = 0;
+
+		if ( pthread_create(&tid_array[i], NULL, zero_thread,
+					&arg_array[i]) ) {
+			fprintf(stderr, "failed to start thread\n");
+			error = 1;
+			break;
+		}
+	}
+
+	/* threads that did start drain the whole queue between them */
+	while (--i >= 0) {
+		pthread_join(tid_array[i], &ret);
+		if ( ret ) {
+			error = 1;
+		}
+		*modified += arg_array[i].modified;
+	}
+
+out:
+	free(tid_array);
+	free(arg_array);
+	return error ? -1 : 0;
+}
+
+/*
+ * Find the first run of free blocks in [blk, end].  The bitmap is searched
+ * with the libext2fs find_first helpers, which skip whole words of used
+ * blocks at a time.  Returns ENOENT when no free block is left.
+ */
+errcode_t next_free_extent(ext2_filsys fs, blk64_t blk, blk64_t end,
+		blk64_t *first, blk64_t *count)
+{
+	errcode_t ret;
+	blk64_t used;
+
+	ret = ext2fs_find_first_zero_block_bitmap2(fs->block_map, blk, end,
+							first);
+	if ( ret )
+		return ret;
 
-		pivot += part_size;
+	ret = ext2fs_find_first_set_block_bitmap2(fs->block_map, *first, end,
+							&used);
+	if ( ret )
+		used = end + 1;
 
-		ret = pthread_create(&tid_array[i], NULL, zero_thread,
-					&arg_array[i]);
+	*count = used - *first;
+	return 0;
+}
+
+/*
+ * Process every free extent in [start, end).  Returns -1 on error and 1
+ * if a stop was requested before the range was finished.
+ */
+int zero_range(struct zero_worker *w, blk64_t start, blk64_t end)
+{
+	struct report *rep = w->opts->report;
+	blk64_t blk, first, count;
+
+	blk = start;
+	while ( blk < end &&
+		!next_free_extent(w->fs, blk, end - 1, &first, &count) ) {
+		if ( stop_requested )
+			return 1;
+		if ( rep )
+			report_extent(rep, ext2fs_group_of_blk2(w->fs, first),
+					first, count);
+		if ( zero_extent(w, first, count) )
+			return -1;
+		blk = first + count;
+	}
+
+	return 0;
+}
+
+/*
+ * Process one work item and record it as finished.  With a report the
+ * engine is drained first, since it counts dirty blocks as it checks
+ * them.  A method that reads nothing cannot tell dirty blocks from
+ * clean ones, so every block it clears is reported as dirty.  Returns
+ * -1 on error and 1 if a stop was requested.
+ */
+int run_item(struct zero_worker *w, const struct work_item *item)
+{
+	const struct zero_opts *opts = w->opts;
+	struct report *rep = opts->report;
+	dgrp_t group = ext2fs_group_of_blk2(w->fs, item->start);
+	blk64_t *dirty = opts->discard || opts->punch || opts->zeroout ||
+			opts->blind ? &w->modified : &w->dirty;
+	blk64_t before = *dirty;
+	int ret;
+
+	if ( rep )
+		report_group_start(rep, group);
+
+	ret = zero_range(w, item->start, item->end);
+	if ( ret )
+		return ret;
+
+	if ( rep ) {
+		if ( worker_drain(w) )
+			return -1;
+		report_dirty(rep, group, *dirty - before);
+	}
+
+	return item_done(w, item);
+}
+
+/*
+ * Record a finished work item in the clean cache and the checkpoint, if
+ * there are any.  The clean cache is only saved once every worker is
+ * done, but the checkpoint needs the item's writes complete first, so an
+ * I/O engine is drained, and a periodic save flushes the device before
+ * it records anything.
+ */
+int item_done(struct zero_worker *w, const struct work_item *item)
+{
+	struct checkpoint *ck = w->opts->ckpt;
+	dgrp_t group = ext2fs_group_of_blk2(w->fs, item->start);
+
+	if ( w->opts->clean )
+		clean_mark(w->opts->clean, group);
+
+	if ( ck == NULL )
+		return 0;
+
+	if ( worker_drain(w) )
+		return -1;
+
+	ckpt_mark(ck, group);
+
+	/* a failed save only means more work after a resume */
+	if ( ckpt_due(ck) )
+		ckpt_save(ck, w->opts->dryrun ? -1 : w->fd);
+
+	return 0;
+}
+
+void request_stop(int sig)
+{
+	stop_requested = 1;
+}
+
+/*
+ * Open a private descriptor on the device and allocate the chunk buffer.
+ * With a queue depth the worker also gets its own io_uring; if the kernel
+ * will not give us one we say so and carry on synchronously.
+ */
+int worker_init(struct zero_worker *w, ext2_filsys fs,
+		const struct zero_opts *opts)
+{
+	memset(w, 0, sizeof(*w));
+	w->fs = fs;
+	w->opts = opts;
+
+	w->fd = open(opts->device, opts->dryrun ? O_RDONLY : O_RDWR);
+	if ( w->fd < 0 ) {
+		fprintf(stderr, "failed to open %s\n", opts->device);
+		return -1;
+	}
+
+	w->buf = malloc((size_t)opts->chunk_blocks * fs->blocksize);
+	if ( w->buf == NULL ) {
+		fprintf(stderr, "out of memory (surely not?)\n");
+		close(w->fd);
+		return -1;
+	}
+
+	if ( opts->queue_depth ) {
+		w->eng = uring_engine_new(w);
+		if ( w->eng == NULL )
+			fprintf(stderr, "io_uring unavailable, using"
+					" synchronous I/O\n");
+	}
+
+	/* a discard needs no reading, so there is nothing to pipeline */
+	if ( opts->checkers && !opts->discard ) {
+		w->pipe = pipeline_new(w);
+		if ( w->pipe == NULL )
+			fprintf(stderr, "failed to start pipeline, using"
+					" synchronous I/O\n");
+	}
+
+	return 0;
+}
+
+/*
+ * Wait until the worker's engine, if it has one, has finished every
+ * read and write queued so far.
+ */
+int worker_drain(struct zero_worker *w)
+{
+	if ( (w->eng && uring_engine_drain(w->eng)) ||
+		(w->pipe && pipeline_drain(w->pipe)) ) {
+		w->error = 1;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Wait for outstanding I/O, flush what we wrote and release the worker.
+ * Returns -1 if anything went wrong during the run.
+ */
+int worker_done(struct zero_worker *w)
+{
+	if ( w->eng && uring_engine_finish(w->eng) )
+		w->error = 1;
+	if ( w->pipe && pipeline_finish(w->pipe) )
+		w->error = 1;
+
+	if ( !w->opts->dryrun && fsync(w->fd) ) {
+		fprintf(stderr, "error while flushing %s\n", w->opts->device);
+		w->error = 1;
+	}
+
+	close(w->fd);
+	free(w->buf);
+
+	return w->error ? -1 : 0;
+}
+
+/*
+ * Read count blocks starting at blk into buf, which must hold them all.
+ */
+int read_blocks(struct zero_worker *w, blk64_t blk, unsigned int count,
+		unsigned char *buf)
+{
+	struct throttle *th = w->opts->throttle;
+	struct timespec start;
+	unsigned long long off, left;
+	unsigned char *p;
+	ssize_t ret;
+	int err = 0;
+
+	off = blk * w->fs->blocksize;
+	left = (unsigned long long)count * w->fs->blocksize;
+	p = buf;
+
+	if ( w->opts->rate )
+		rate_read(w->opts->rate, left);
+	if ( th )
+		throttle_begin(th, &start);
+
+	while ( left ) {
+		ret = pread(w->fd, p, left, off);
+		if ( ret < 0 ) {
+			if ( errno == EINTR )
+				continue;
+			err = errno;
+			break;
+		}
+		if ( ret == 0 ) {
+			err = EIO;
+			break;
+		}
+		p += ret;
+		off += ret;
+		left -= ret;
 	}
 
-	/* process the remaining blocks */
-	if (pivot < fs->super->s_blocks_count) {
-		for (blk = pivot; blk < fs->super->s_blocks_count; blk++)
-		{
-			zero_func(fs, blk, buf, empty, fillval, dryrun,
-				discard, &error);
+	if ( th )
+		throttle_end(th, &start);
+	return err;
+}
+
+/*
+ * Write count blocks of the fill pattern starting at blk with pwritev().
+ * Every iovec points at the same one-block empty buffer, so a long run
+ * costs no more memory than a single block.
+ */
+int write_fill(struct zero_worker *w, blk64_t blk, blk64_t count)
+{
+	ext2_filsys fs = w->fs;
+	struct throttle *th = w->opts->throttle;
+	struct timespec start;
+	struct iovec iov[IOV_MAX];
+	unsigned long long stripe, edge, off, left, want, len;
+	unsigned int part;
+	ssize_t ret;
+	int n;
+
+	off = blk * fs->blocksize;
+	left = count * fs->blocksize;
+	stripe = w->opts->stripe * fs->blocksize;
+
+	while ( left ) {
+		/* after a short write, resume part way into a block */
+		part = off % fs->blocksize;
+		want = left;
+
+		/* end on a RAID stripe boundary if one is within reach */
+		if ( stripe ) {
+			edge = (off + (unsigned long long)IOV_MAX *
+					fs->blocksize - part) / stripe * stripe;
+			if ( edge > off && edge - off < want )
+				want = edge - off;
+		}
+
+		len = want;
+		for (n = 0; n < IOV_MAX && len; n++) {
+			iov[n].iov_base = w->opts->empty + part;
+			iov[n].iov_len = fs->blocksize - part;
+			if ( iov[n].iov_len > len )
+				iov[n].iov_len = len;
+			len -= iov[n].iov_len;
+			part = 0;
 		}
+
+		/* only what this call can write, not the whole run */
+		if ( w->opts->rate )
+			rate_write(w->opts->rate, want - len);
+		if ( th )
+			throttle_begin(th, &start);
+		ret = pwritev(w->fd, iov, n, off);
+		if ( th )
+			throttle_end(th, &start);
+		if ( ret < 0 ) {
+			if ( errno == EINTR )
+				continue;
+			return errno;
+		}
+		off += ret;
+		left -= ret;
 	}
 
-	pthread_barrier_wait(&g_thread_barrier);
-	for (i=0; i < thread_count; i++) {
-		pthread_join(tid_array[i], NULL);
+	return 0;
+}
+
+/*
+ * Write the fill value over the unaligned end of a discarded extent.
+ */
+static int discard_edge(struct zero_worker *w, blk64_t blk, blk64_t count)
+{
+	if ( !count )
+		return 0;
+
+	worker_modified(w, count);
+	if ( !w->opts->dryrun && write_fill(w, blk, count) ) {
+		fprintf(stderr, "error while writing block\n");
+		w->error = 1;
+		return -1;
 	}
 
-	free(tid_array);
-	free(arg_array);
+	return 0;
 }
 
-inline void zero_func(ext2_filsys fs, unsigned long blk, unsigned char* buf,
-		unsigned char* empty, unsigned int fillval, int dryrun,
-		int discard, int *error)
+/*
+ * Discard the free blocks first .. first+count-1, one request per extent,
+ * split only at the device limit.  Block devices get BLKDISCARD and image
+ * files get a hole punched, as libext2fs' unix_io would do.  Where the
+ * device has a discard granularity the extent is trimmed to whole
+ * granules; the ends cut off are written with the fill value when
+ * opts->discard_edges is set, and left alone otherwise.
+ */
+int discard_extent(struct zero_worker *w, blk64_t first, blk64_t count)
 {
-	int ret, i;
-	if ( ext2fs_test_block_bitmap(fs->block_map, blk) ) {
-		goto _exit;
+	const struct zero_opts *opts = w->opts;
+	unsigned long long range[2];
+	blk64_t blk, start, end, n, gran;
+	struct timespec issued;
+	int ret;
+
+	start = first;
+	end = first + count;
+	gran = opts->discard_gran;
+	if ( gran ) {
+		start += (gran - (first + gran - opts->discard_align) % gran) %
+									gran;
+		end -= (end + gran - opts->discard_align) % gran;
+		if ( start >= end )
+			start = end = first + count;
 	}
 
-	if (!discard) {
-		LOCK(fs_mux);
-		ret = io_channel_read_blk(fs->io, blk, 1, buf);
-		UNLOCK(fs_mux);
+	worker_scanned(w, count - (end - start));
+	if ( opts->discard_edges &&
+		(discard_edge(w, first, start - first) ||
+		 discard_edge(w, end, first + count - end)) )
+		return -1;
+
+	for (blk = start; blk < end; blk += n) {
+		n = end - blk;
+		if ( opts->discard_max && n > opts->discard_max )
+			n = opts->discard_max;
+
+		worker_scanned(w, n);
+		worker_modified(w, n);
+		if ( opts->dryrun )
+			continue;
+
+		if ( opts->rate )
+			rate_op(opts->rate);
+		range[0] = blk * w->fs->blocksize;
+		range[1] = n * w->fs->blocksize;
+		if ( opts->throttle )
+			throttle_begin(opts->throttle, &issued);
+		if ( opts->dev.is_blkdev )
+			ret = ioctl(w->fd, BLKDISCARD, range);
+		else
+			ret = fallocate(w->fd, FALLOC_FL_PUNCH_HOLE |
+					FALLOC_FL_KEEP_SIZE, range[0], range[1]);
+		if ( opts->throttle )
+			throttle_end(opts->throttle, &issued);
 		if ( ret ) {
-			fprintf(stderr, "error while reading block\n");
-			*error = 1;
-			goto _exit;
+			fprintf(stderr, "error while discarding block\n");
+			w->error = 1;
+			return -1;
 		}
+	}
+
+	return 0;
+}
 
-		ret = memcmp(buf, empty, fs->blocksize);
-		if ( 0 == ret )
-			goto _exit;
+/*
+ * Punch the free blocks first .. first+count-1 out of an image file in a
+ * single call.  The holes read back as zeros and take no space, so the
+ * image shrinks in place without any data being written.
+ */
+int punch_extent(struct zero_worker *w, blk64_t first, blk64_t count)
+{
+	struct throttle *th = w->opts->throttle;
+	struct timespec start;
+	int ret;
+
+	worker_scanned(w, count);
+	worker_modified(w, count);
+	if ( w->opts->dryrun )
+		return 0;
+
+	if ( w->opts->rate )
+		rate_op(w->opts->rate);
+	if ( th )
+		throttle_begin(th, &start);
+	ret = fallocate(w->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			first * w->fs->blocksize, count * w->fs->blocksize) ?
+			errno : 0;
+	if ( th )
+		throttle_end(th, &start);
+	if ( ret ) {
+		fprintf(stderr, "error while punching hole: %s\n",
+			strerror(ret));
+		w->error = 1;
+		return -1;
 	}
 
-	if ( !dryrun ) {
-		if (!discard) {
-			LOCK(fs_mux);
-			ret = io_channel_write_blk(fs->io, blk, 1, empty);
-			UNLOCK(fs_mux);
-			if ( ret ) {
-				fprintf(stderr, "error while writing block\n");
-				*error = 1;
-				goto _exit;
+	return 0;
+}
+
+/*
+ * Have the device zero the free blocks first .. first+count-1, split at
+ * its write zeroes limit: BLKZEROOUT for a block device, ZERO_RANGE for
+ * an image file.  Where the call is not supported the range is written
+ * the ordinary way.  No data crosses the bus for the call itself, so it
+ * only counts against the IOPS limit.
+ */
+int zeroout_extent(struct zero_worker *w, blk64_t first, blk64_t count)
+{
+	const struct zero_opts *opts = w->opts;
+	unsigned long long range[2];
+	blk64_t blk, end, n;
+	struct timespec start;
+	int ret, err;
+
+	end = first + count;
+	for (blk = first; blk < end; blk += n) {
+		n = end - blk;
+		if ( opts->zeroout_max && n > opts->zeroout_max )
+			n = opts->zeroout_max;
+
+		worker_scanned(w, n);
+		worker_modified(w, n);
+		if ( opts->dryrun )
+			continue;
+
+		if ( opts->rate )
+			rate_op(opts->rate);
+		range[0] = blk * w->fs->blocksize;
+		range[1] = n * w->fs->blocksize;
+		if ( opts->throttle )
+			throttle_begin(opts->throttle, &start);
+		if ( opts->dev.is_blkdev )
+			ret = ioctl(w->fd, BLKZEROOUT, range);
+		else
+			ret = fallocate(w->fd, FALLOC_FL_ZERO_RANGE |
+					FALLOC_FL_KEEP_SIZE, range[0], range[1]);
+		err = errno;
+		if ( opts->throttle )
+			throttle_end(opts->throttle, &start);
+		if ( ret && (err == EOPNOTSUPP || err == ENOTTY ||
+				err == EINVAL) )
+			ret = write_fill(w, blk, n);
+		if ( ret ) {
+			fprintf(stderr, "error while zeroing block\n");
+			w->error = 1;
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Zero (or discard) the free blocks first .. first+count-1.  Blocks are
+ * read opts->chunk_blocks at a time into the worker's buffer.  Adjacent
+ * blocks that need rewriting are written together, even when the run
+ * crosses a chunk boundary, and widened to whole RAID stripes; runs
+ * whose stripes touch go out as one write.  Returns -1 on error.
+ */
+int zero_extent(struct zero_worker *w, blk64_t first, blk64_t count)
+{
+	const struct zero_opts *opts = w->opts;
+	unsigned int blocksize = w->fs->blocksize;
+	blk64_t blk, end, run, run_len, until, start = 0, ndirty;
+	unsigned int i, n;
+	unsigned char *p;
+	int dirty, ended;
+
+	if ( w->eng )
+		return uring_zero_extent(w->eng, first, count);
+	if ( w->pipe )
+		return pipeline_zero_extent(w->pipe, first, count);
+
+	if ( opts->discard )
+		return discard_extent(w, first, count);
+	if ( opts->punch )
+		return punch_extent(w, first, count);
+	if ( opts->zeroout )
+		return zeroout_extent(w, first, count);
+
+	/* blind mode writes the whole extent without looking at it */
+	if ( opts->blind ) {
+		worker_scanned(w, count);
+		worker_modified(w, count);
+		if ( !opts->dryrun && write_fill(w, first, count) ) {
+			fprintf(stderr, "error while writing block\n");
+			w->error = 1;
+			return -1;
+		}
+		return 0;
+	}
+
+	end = first + count;
+	run = run_len = until = 0;
+	for (blk = first; blk < end; blk += n) {
+		n = chunk_len(opts, blk, end);
+
+		if ( read_blocks(w, blk, n, w->buf) ) {
+			fprintf(stderr, "error while reading block\n");
+			w->error = 1;
+			return -1;
+		}
+		worker_scanned(w, n);
+
+		ndirty = 0;
+		for (i = 0, p = w->buf; i <= n; i++, p += blocksize) {
+			dirty = i < n && !fill_check(p, blocksize,
+							opts->fillval);
+			ndirty += dirty;
+			dirty = dirty || (i < n && blk + i < until);
+			if ( dirty )
+				start = stripe_start(opts, blk + i, blk);
+
+			/* a run that has reached a clean block is held while
+			 * the next stripe could still carry it on, so runs
+			 * that touch go out as one write */
+			if ( !run_len )
+				ended = 0;
+			else if ( dirty )
+				ended = start > run + run_len;
+			else if ( i < n )
+				ended = blk + i >=
+					stripe_end(opts, run + run_len);
+			else
+				ended = blk + n == end;
+
+			if ( ended ) {
+				worker_modified(w, run_len);
+				if ( !opts->dryrun &&
+					write_fill(w, run, run_len) ) {
+					fprintf(stderr,
+						"error while writing block\n");
+					w->error = 1;
+					return -1;
+				}
+				run_len = 0;
 			}
-		} else { /* discard */
-			LOCK(fs_mux);
-			ret = io_channel_discard(fs->io, blk, 1);
-			UNLOCK(fs_mux);
-			if ( ret ) {
-				fprintf(stderr, "error while discarding block\n");
-				*error = 1;
-				goto _exit;
+			if ( dirty ) {
+				if ( !run_len )
+					run = start;
+				run_len = blk + i + 1 - run;
+				until = stripe_end(opts, blk + i);
 			}
 		}
+		worker_dirty(w, ndirty);
 	}
-_exit:
-	return; /* This is to suppress gcc warning */
+
+	return 0;
 }
 
 void* zero_thread(void* arg)
 {
-	struct thread_arg m_arg = *(struct thread_arg*) arg;
-	unsigned char *buf;
-	unsigned long blk;
-	int	error = 0;
+	struct thread_arg *t_arg = arg;
+	struct thread_arg m_arg = *t_arg;
+	struct zero_worker w;
+	struct work_item item;
+	int	error = 1;
+	int	ret;
 
-	buf = (unsigned char*) malloc(m_arg.fs->blocksize);
-
-	for (blk = m_arg.start_blk; blk < m_arg.end_blk; blk++) {
-		zero_func(m_arg.fs, blk, buf, m_arg.empty, m_arg.fillval,
-				m_arg.dryrun, m_arg.discard, &error);
-		if (error) {
-			break;
+	if (worker_init(&w, m_arg.fs, m_arg.opts) == 0) {
+		if (m_arg.opts->progress) {
+			progress_attach(m_arg.opts->progress, &w, m_arg.index);
+		}
+		while (!stop_requested &&
+			workq_next(m_arg.queue, m_arg.index, &item)) {
+			ret = run_item(&w, &item);
+			if (ret) {
+				break;
+			}
+		}
+		error = worker_done(&w) != 0;
+		t_arg->modified = w.modified;
+		if (m_arg.opts->progress) {
+			progress_detach(m_arg.opts->progress, m_arg.index);
 		}
 	}
 
-	free(buf);
-	pthread_barrier_wait(&g_thread_barrier);
 	return (void*) ((unsigned long) error);
 }
 
-void single_thread(ext2_filsys fs, unsigned int fillval, int dryrun,
-		int verbose, int discard, unsigned char *empty,
-		unsigned char *buf)
+void single_thread(ext2_filsys fs, const struct zero_opts *opts,
+		struct work_queue *plan, blk64_t *modified)
 {
-	unsigned long	blk, free_blk, modified;
+	blk64_t		free_blk;
 	double		percent;
-	int		old_percent, ret, i;
+	int		old_percent;
+	struct zero_worker w;
+	struct work_item item;
+	int		ret;
 
-	free_blk = modified = 0;
+	free_blk = 0;
 	percent = 0.0;
 	old_percent = -1;
 
-	if ( verbose ) {
+	if ( workq_start(plan, 1) || worker_init(&w, fs, opts) ) {
+		bailout((void*) opts->empty, NULL);
+	}
+	if ( opts->progress ) {
+		progress_attach(opts->progress, &w, 0);
+	}
+
+	if ( opts->verbose ) {
 		fprintf(stderr, "\r%4.1f%%", percent);
 	}
 
-	for ( blk=fs->super->s_first_data_block;
-		blk < fs->super->s_blocks_count; blk++ ) {
+	while ( !stop_requested && workq_next(plan, 0, &item) ) {
 
-		if ( ext2fs_test_block_bitmap(fs->block_map, blk) ) {
-			continue;
+		ret = run_item(&w, &item);
+		if ( ret < 0 ) {
+			worker_done(&w);
+			bailout((void*) opts->empty, NULL);
+		}
+		if ( ret > 0 ) {
+			break;
 		}
 
-		++free_blk;
-		percent = 100.0 * (double)free_blk/
-					(double)fs->super->s_free_blocks_count;
+		free_blk += item.cost;
+
+		percent = 100.0 * (double)free_blk/(double)plan->total_cost;
 
-		if ( verbose && (int)(percent*10) != old_percent ) {
+		if ( opts->verbose && (int)(percent*10) != old_percent ) {
 			fprintf(stderr, "\r%4.1f%%", percent);
 			old_percent = (int)(percent*10);
 		}
+	}
 
-		if (!discard) {
-			ret = io_channel_read_blk(fs->io, blk, 1, buf);
-			if ( ret ) {
-				fprintf(stderr, "error while reading block\n");
-				bailout((void*) empty, (void*) buf);
-			}
-			ret = memcmp(buf, empty, fs->blocksize);
-			if ( 0 == ret )
-				continue;
-		}
-
-		++modified;
-
-		if ( !dryrun ) {
-			if (!discard) {
-				ret = io_channel_write_blk(fs->io, blk, 1, empty);
-				if ( ret ) {
-					fprintf(stderr, "error while writing block\n");
-					bailout((void*) empty, (void*) buf);
-				}
-			} else { /* discard */
-				ret = io_channel_discard(fs->io, blk, 1);
-				if ( ret ) {
-					fprintf(stderr, " error while discarding block\n");
-					bailout((void*) empty, (void*) buf);
-				}
-			}
-		}
+	if ( worker_done(&w) ) {
+		bailout((void*) opts->empty, NULL);
+	}
+	*modified = w.modified;
+	if ( opts->progress ) {
+		progress_detach(opts->progress, 0);
 	}
 
-	if ( verbose ) {
-		printf("\r%u/%u/%u\n", modified, free_blk, fs->super->s_blocks_count);
+	if ( opts->verbose ) {
+		printf("\r%llu/%llu/%llu\n", (unsigned long long)w.modified,
+			(unsigned long long)free_blk,
+			(unsigned long long)ext2fs_blocks_count(fs->super));
 	}
 }
@@ -0,0 +1,147 @@
+/*
+ * zerofree - a tool to zero free blocks in an ext2 filesystem
+ *
+ * This file may be redistributed under the terms of the GNU General Public
+ * License, version 2.
+ */
+#ifndef ZEROFREE_H
+#define ZEROFREE_H
+
+#include <ext2fs/ext2fs.h>
+
+#include "devinfo.h"
+
+/* settings shared read-only by every thread */
+struct zero_opts {
+	unsigned int	fillval;
+	int		dryrun;
+	int		verbose;
+	int		discard;
+	int		blind;		/* write free blocks without reading */
+	int		punch;		/* punch holes in an image file */
+	int		zeroout;	/* offload zeroing to the device */
+	unsigned int	chunk_blocks;	/* blocks per read request */
+	blk64_t		stripe;		/* RAID stripe in blocks, 0 = none */
+	unsigned int	queue_depth;	/* io_uring reads in flight, 0 = sync */
+	unsigned int	checkers;	/* pipeline check threads, 0 = none */
+	int		ordered;	/* pipeline reads and writes in turn */
+	unsigned char	*empty;		/* one block of fillval */
+	const char	*device;
+	struct dev_info	dev;
+	blk64_t		discard_max;	/* blocks per discard, 0 = no limit */
+	blk64_t		discard_gran;	/* blocks, 0 = no alignment needed */
+	blk64_t		discard_align;	/* first aligned block mod gran */
+	int		discard_edges;	/* write the unaligned ends instead */
+	blk64_t		zeroout_max;	/* blocks per zeroout, 0 = no limit */
+	struct checkpoint *ckpt;	/* NULL unless --checkpoint */
+	struct clean_cache *clean;	/* NULL unless --clean-cache */
+	struct report	*report;	/* NULL unless --report */
+	struct progress	*progress;	/* NULL unless --progress-fd */
+	struct rate_limit *rate;	/* NULL unless a --max-* limit */
+	struct throttle	*throttle;	/* NULL unless --latency-target */
+};
+
+/*
+ * Per-thread I/O state.  Each worker reads and writes data blocks through
+ * its own descriptor with positional I/O, so workers never contend for
+ * the libext2fs io_channel, which is left to metadata.
+ */
+struct zero_worker {
+	ext2_filsys		fs;
+	const struct zero_opts	*opts;
+	int			fd;
+	unsigned char		*buf;		/* chunk_blocks blocks */
+	struct uring_engine	*eng;		/* NULL for synchronous I/O */
+	struct pipeline		*pipe;		/* NULL unless -p was given */
+	blk64_t			modified;	/* blocks written or discarded */
+	blk64_t			dirty;		/* of those read, not the fill */
+	blk64_t			scanned;	/* free blocks visited */
+	int			error;
+};
+
+/*
+ * The progress thread reads the counters while the worker, and its
+ * engine's threads, update them.
+ */
+static inline void worker_modified(struct zero_worker *w, blk64_t n)
+{
+	__atomic_fetch_add(&w->modified, n, __ATOMIC_RELAXED);
+}
+
+static inline void worker_dirty(struct zero_worker *w, blk64_t n)
+{
+	__atomic_fetch_add(&w->dirty, n, __ATOMIC_RELAXED);
+}
+
+static inline void worker_scanned(struct zero_worker *w, blk64_t n)
+{
+	__atomic_fetch_add(&w->scanned, n, __ATOMIC_RELAXED);
+}
+
+/*
+ * The most I/Os one worker has in flight at once.  Of a pipeline's
+ * threads only the reader and the writer do I/O, and with --ordered
+ * they take turns.
+ */
+static inline unsigned int worker_depth(const struct zero_opts *opts)
+{
+	if ( opts->queue_depth )
+		return opts->queue_depth;
+	return opts->checkers && !opts->ordered ? 2 : 1;
+}
+
+unsigned int online_cpus(void);
+errcode_t next_free_extent(ext2_filsys fs, blk64_t blk, blk64_t end,
+		blk64_t *first, blk64_t *count);
+/*
+ * Blocks to read from blk on, up to end.  With a RAID stripe, chunks are
+ * cut at multiples of chunk_blocks, which is a whole number of stripes,
+ * so no stripe is split between two chunks.
+ */
+static inline blk64_t chunk_len(const struct zero_opts *opts, blk64_t blk,
+		blk64_t end)
+{
+	blk64_t n = opts->chunk_blocks;
+
+	if ( opts->stripe )
+		n -= blk % n;
+	return end - blk < n ? end - blk : n;
+}
+
+/*
+ * A dirty block makes its whole RAID stripe dirty, as far as the chunk
+ * goes, so that the array is sent full stripes rather than having to
+ * read, modify and write them.  The rest of the stripe is free and holds
+ * the fill value already, so writing it again does no harm.  These give
+ * the first block of blk's stripe, no lower than floor, and the block
+ * after it, or 0 without a stripe.
+ */
+static inline blk64_t stripe_start(const struct zero_opts *opts, blk64_t blk,
+		blk64_t floor)
+{
+	blk64_t start;
+
+	if ( !opts->stripe )
+		return blk;
+	start = blk - blk % opts->stripe;
+	return start < floor ? floor : start;
+}
+
+static inline blk64_t stripe_end(const struct zero_opts *opts, blk64_t blk)
+{
+	return opts->stripe ? blk - blk % opts->stripe + opts->stripe : 0;
+}
+
+int worker_init(struct zero_worker *w, ext2_filsys fs,
+		const struct zero_opts *opts);
+int worker_drain(struct zero_worker *w);
+int worker_done(struct zero_worker *w);
+int zero_extent(struct zero_worker *w, blk64_t first, blk64_t count);
+int discard_extent(struct zero_worker *w, blk64_t first, blk64_t count);
+int punch_extent(struct zero_worker *w, blk64_t first, blk64_t count);
+int zeroout_extent(struct zero_worker *w, blk64_t first, blk64_t count);
+int read_blocks(struct zero_worker *w, blk64_t blk, unsigned int count,
+		unsigned char *buf);
+int write_fill(struct zero_worker *w, blk64_t blk, blk64_t count);
+
+#endif